@@ -0,0 +1,138 @@
+// Counts the heap allocations per message of pushing and executing closures shaped like
+// the MQTT message tasks: a payload vector and a topic string moved into the closure.
+// Compares TaskQueue with a std::function queue copying the top element before popping,
+// which is how TaskQueue used to store and pop tasks.
+//
+// The results are printed to stderr, the loggers write every task to stdout.
+
+#include "LoggerFactory.h"
+#include "TaskQueue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace
+{
+    std::atomic_bool counting{ false };
+    std::atomic_uint64_t allocations{ 0 };
+
+    constexpr std::size_t MessageCount = 100'000;
+    constexpr std::size_t PayloadSize = 64;
+
+    struct Message
+    {
+        std::vector<std::uint8_t> payload;
+        std::string topic;
+    };
+
+    // Built before counting, only the allocations of queueing the messages are measured
+    std::vector<Message> makeMessages()
+    {
+        std::vector<Message> messages(MessageCount);
+
+        for (auto i = 0u; i < MessageCount; ++i) {
+            messages[i].payload.assign(PayloadSize, static_cast<std::uint8_t>(i));
+            messages[i].topic = "zigbee2mqtt/living-room/sensor-" + std::to_string(i);
+        }
+
+        return messages;
+    }
+
+    double measureTaskQueue(const LoggerFactory& loggerFactory)
+    {
+        auto messages = makeMessages();
+        TaskQueue taskQueue{ loggerFactory };
+        std::size_t received = 0;
+
+        allocations = 0;
+        counting = true;
+
+        for (auto& message : messages) {
+            taskQueue.push("MqttOnMessage", [&received, message = std::move(message)](auto&) {
+                received += message.payload.size() + message.topic.size();
+            });
+        }
+
+        // Pushed last with the same key and priority, so it runs after the messages
+        taskQueue.push("Shutdown", [&taskQueue](auto&) {
+            counting = false;
+            taskQueue.shutdown();
+        });
+
+        taskQueue.exec();
+
+        return static_cast<double>(allocations) / MessageCount;
+    }
+
+    double measureStdFunction()
+    {
+        auto messages = makeMessages();
+        std::vector<std::function<void ()>> queue;
+        std::size_t received = 0;
+
+        queue.reserve(MessageCount);
+        allocations = 0;
+        counting = true;
+
+        for (auto& message : messages) {
+            queue.emplace_back([&received, message = std::move(message)] {
+                received += message.payload.size() + message.topic.size();
+            });
+        }
+
+        for (const auto& queued : queue) {
+            // std::priority_queue::top() only gives const access, so the task was copied out
+            auto task = queued;
+            task();
+        }
+
+        counting = false;
+        queue.clear();
+
+        return static_cast<double>(allocations) / MessageCount;
+    }
+}
+
+void* operator new(const std::size_t size)
+{
+    if (counting.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (auto* p = std::malloc(size != 0 ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+int main()
+{
+    LoggerFactory loggerFactory;
+
+    const auto stdFunction = measureStdFunction();
+    const auto taskQueue = measureTaskQueue(loggerFactory);
+
+    std::fprintf(stderr, "messages: %zu, payload: %zu bytes\n", MessageCount, PayloadSize);
+    std::fprintf(stderr, "std::function, copied on pop: %.2f allocations per message\n", stdFunction);
+    std::fprintf(stderr, "TaskQueue:                    %.2f allocations per message\n", taskQueue);
+    std::fprintf(stderr, "removed:                      %.2f allocations per message\n", stdFunction - taskQueue);
+
+    return 0;
+}
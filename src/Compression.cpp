@@ -0,0 +1,135 @@
+#include "Compression.h"
+#include "ContentNegotiation.h"
+
+#include <zlib.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+    std::string gzip(const std::string_view content)
+    {
+        z_stream stream{};
+
+        // 16 + MAX_WBITS selects the gzip wrapper
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return {};
+        }
+
+        std::string compressed;
+        compressed.resize(deflateBound(&stream, content.size()));
+
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+        stream.avail_in = content.size();
+        stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+        stream.avail_out = compressed.size();
+
+        const auto result = deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        if (result != Z_STREAM_END) {
+            return {};
+        }
+
+        return compressed;
+    }
+
+#ifdef WITH_ZSTD
+    std::string zstd(const std::string_view content)
+    {
+        std::string compressed;
+        compressed.resize(ZSTD_compressBound(content.size()));
+
+        const auto size = ZSTD_compress(
+            compressed.data(),
+            compressed.size(),
+            content.data(),
+            content.size(),
+            ZSTD_CLEVEL_DEFAULT
+        );
+
+        if (ZSTD_isError(size)) {
+            return {};
+        }
+
+        compressed.resize(size);
+
+        return compressed;
+    }
+#endif
+}
+
+ContentEncoding negotiateContentEncoding(const std::string_view acceptEncoding)
+{
+    auto best = ContentEncoding::Identity;
+    auto bestQuality = 0.0;
+    // Identity is acceptable unless it's explicitly weighted
+    auto identityQuality = 0.0;
+
+    for (const auto& entry : parseAcceptHeader(acceptEncoding)) {
+        auto encoding = ContentEncoding::Identity;
+
+        if (equalsIgnoreCase(entry.value, "identity")) {
+            identityQuality = entry.quality;
+        } else if (equalsIgnoreCase(entry.value, "gzip")) {
+            encoding = ContentEncoding::Gzip;
+#ifdef WITH_ZSTD
+        } else if (equalsIgnoreCase(entry.value, "zstd")) {
+            encoding = ContentEncoding::Zstd;
+#endif
+        }
+
+        // Prefer the better compressing encoding when the weights are equal
+        if (
+            encoding != ContentEncoding::Identity
+            && entry.quality > 0
+            && (entry.quality > bestQuality || (entry.quality == bestQuality && encoding > best))
+        ) {
+            best = encoding;
+            bestQuality = entry.quality;
+        }
+    }
+
+    if (identityQuality > bestQuality) {
+        return ContentEncoding::Identity;
+    }
+
+    return best;
+}
+
+std::string compress(const std::string_view content, const ContentEncoding encoding)
+{
+    switch (encoding) {
+        case ContentEncoding::Gzip:
+            return gzip(content);
+
+#ifdef WITH_ZSTD
+        case ContentEncoding::Zstd:
+            return zstd(content);
+#endif
+
+        default:
+            break;
+    }
+
+    return std::string{ content };
+}
+
+const char* toString(const ContentEncoding encoding)
+{
+    switch (encoding) {
+        case ContentEncoding::Gzip:
+            return "gzip";
+
+        case ContentEncoding::Zstd:
+            return "zstd";
+
+        default:
+            break;
+    }
+
+    return "identity";
+}
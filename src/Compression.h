@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+enum class ContentEncoding
+{
+    Identity,
+    Gzip,
+    Zstd
+};
+
+// Number of ContentEncoding values, can be used to size lookup tables
+inline constexpr auto ContentEncodingCount = 3u;
+
+// Picks the best supported encoding from the value of an Accept-Encoding header
+ContentEncoding negotiateContentEncoding(std::string_view acceptEncoding);
+
+// Returns an empty string if compression fails
+std::string compress(std::string_view content, ContentEncoding encoding);
+
+// Value of the Content-Encoding header
+const char* toString(ContentEncoding encoding);
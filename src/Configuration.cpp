@@ -8,11 +8,18 @@ namespace Objects
 {
     static constexpr auto Http = "http";
     static constexpr auto Mqtt = "mqtt";
+    static constexpr auto Metrics = "metrics";
+    static constexpr auto TaskQueue = "taskQueue";
 }
 
 namespace Fields::Http
 {
     static constexpr auto ServerPort = "serverPort";
+    static constexpr auto ThreadPoolSize = "threadPoolSize";
+    static constexpr auto UseEpoll = "useEpoll";
+    static constexpr auto ConnectionLimit = "connectionLimit";
+    static constexpr auto ConnectionMemoryLimit = "connectionMemoryLimit";
+    static constexpr auto Listeners = "listeners";
 }
 
 namespace Fields::Mqtt
@@ -23,6 +30,49 @@ namespace Fields::Mqtt
     static constexpr auto Topics = "topics";
     static constexpr auto Username = "username";
     static constexpr auto Password = "password";
+    static constexpr auto MessageQueueSize = "messageQueueSize";
+    static constexpr auto MessageBatchSize = "messageBatchSize";
+    static constexpr auto Allow = "allow";
+    static constexpr auto Deny = "deny";
+}
+
+namespace Fields::Metrics
+{
+    static constexpr auto PublishIntervalMs = "publishIntervalMs";
+    static constexpr auto Streaming = "streaming";
+    static constexpr auto Timestamps = "timestamps";
+    static constexpr auto TtlSeconds = "ttlSeconds";
+    static constexpr auto CoalesceIntervalMs = "coalesceIntervalMs";
+    static constexpr auto MaxSeries = "maxSeries";
+    static constexpr auto MaxMemoryBytes = "maxMemoryBytes";
+    static constexpr auto OverflowPolicy = "overflowPolicy";
+    static constexpr auto SeriesAdmissionRate = "seriesAdmissionRate";
+    static constexpr auto Rules = "rules";
+}
+
+namespace Fields::Metrics::Rule
+{
+    static constexpr auto Topic = "topic";
+    static constexpr auto Metric = "metric";
+    static constexpr auto Help = "help";
+    static constexpr auto Unit = "unit";
+    static constexpr auto Fields = "fields";
+    static constexpr auto TtlSeconds = "ttlSeconds";
+    static constexpr auto CoalesceIntervalMs = "coalesceIntervalMs";
+    static constexpr auto Aggregate = "aggregate";
+}
+
+namespace Fields::Metrics::Rule::Aggregation
+{
+    static constexpr auto Count = "count";
+    static constexpr auto WindowSeconds = "windowSeconds";
+    static constexpr auto Buckets = "buckets";
+    static constexpr auto Quantiles = "quantiles";
+}
+
+namespace Fields::TaskQueue
+{
+    static constexpr auto Workers = "workers";
 }
 
 Configuration::Configuration(const LoggerFactory& loggerFactory)
@@ -60,6 +110,14 @@ void Configuration::processJson(const nlohmann::json& json)
     if (json.contains(Objects::Mqtt)) {
         processMqtt(json[Objects::Mqtt]);
     }
+
+    if (json.contains(Objects::Metrics)) {
+        processMetrics(json[Objects::Metrics]);
+    }
+
+    if (json.contains(Objects::TaskQueue)) {
+        processTaskQueue(json[Objects::TaskQueue]);
+    }
 }
 
 void Configuration::processHttp(const nlohmann::json& json)
@@ -78,6 +136,47 @@ void Configuration::processHttp(const nlohmann::json& json)
         _http.serverPort = json[Fields::Http::ServerPort];
         _log.info("{}.{}={}", Objects::Http, Fields::Http::ServerPort, _http.serverPort);
     }
+
+    if (
+        json.contains(Fields::Http::ThreadPoolSize)
+        && json[Fields::Http::ThreadPoolSize].is_number_unsigned()
+    ) {
+        _http.threadPoolSize = json[Fields::Http::ThreadPoolSize];
+        _log.info("{}.{}={}", Objects::Http, Fields::Http::ThreadPoolSize, _http.threadPoolSize);
+    }
+
+    if (
+        json.contains(Fields::Http::UseEpoll)
+        && json[Fields::Http::UseEpoll].is_boolean()
+    ) {
+        _http.useEpoll = json[Fields::Http::UseEpoll];
+        _log.info("{}.{}={}", Objects::Http, Fields::Http::UseEpoll, _http.useEpoll);
+    }
+
+    if (
+        json.contains(Fields::Http::ConnectionLimit)
+        && json[Fields::Http::ConnectionLimit].is_number_unsigned()
+    ) {
+        _http.connectionLimit = json[Fields::Http::ConnectionLimit];
+        _log.info("{}.{}={}", Objects::Http, Fields::Http::ConnectionLimit, _http.connectionLimit);
+    }
+
+    if (
+        json.contains(Fields::Http::ConnectionMemoryLimit)
+        && json[Fields::Http::ConnectionMemoryLimit].is_number_unsigned()
+    ) {
+        _http.connectionMemoryLimit = json[Fields::Http::ConnectionMemoryLimit];
+        _log.info("{}.{}={}", Objects::Http, Fields::Http::ConnectionMemoryLimit, _http.connectionMemoryLimit);
+    }
+
+    if (
+        json.contains(Fields::Http::Listeners)
+        && json[Fields::Http::Listeners].is_number_unsigned()
+        && json[Fields::Http::Listeners] > 0
+    ) {
+        _http.listeners = json[Fields::Http::Listeners];
+        _log.info("{}.{}={}", Objects::Http, Fields::Http::Listeners, _http.listeners);
+    }
 }
 
 void Configuration::processMqtt(const nlohmann::json& json)
@@ -142,4 +241,331 @@ void Configuration::processMqtt(const nlohmann::json& json)
         _mqtt.password = json[Fields::Mqtt::Password];
         _log.info("{}.{}={}", Objects::Mqtt, Fields::Mqtt::Password, _mqtt.password);
     }
-}
\ No newline at end of file
+
+    if (
+        json.contains(Fields::Mqtt::MessageQueueSize)
+        && json[Fields::Mqtt::MessageQueueSize].is_number_unsigned()
+        && json[Fields::Mqtt::MessageQueueSize] > 0
+    ) {
+        _mqtt.messageQueueSize = json[Fields::Mqtt::MessageQueueSize];
+        _log.info("{}.{}={}", Objects::Mqtt, Fields::Mqtt::MessageQueueSize, _mqtt.messageQueueSize);
+    }
+
+    if (
+        json.contains(Fields::Mqtt::MessageBatchSize)
+        && json[Fields::Mqtt::MessageBatchSize].is_number_unsigned()
+        && json[Fields::Mqtt::MessageBatchSize] > 0
+    ) {
+        _mqtt.messageBatchSize = json[Fields::Mqtt::MessageBatchSize];
+        _log.info("{}.{}={}", Objects::Mqtt, Fields::Mqtt::MessageBatchSize, _mqtt.messageBatchSize);
+    }
+
+    if (
+        json.contains(Fields::Mqtt::Allow)
+        && json[Fields::Mqtt::Allow].is_array()
+    ) {
+        for (const auto& filter : json[Fields::Mqtt::Allow]) {
+            if (!filter.is_string()) {
+                continue;
+            }
+
+            _mqtt.allow.push_back(filter);
+            _log.info("{}.{}={}", Objects::Mqtt, Fields::Mqtt::Allow, static_cast<std::string>(filter));
+        }
+    }
+
+    if (
+        json.contains(Fields::Mqtt::Deny)
+        && json[Fields::Mqtt::Deny].is_array()
+    ) {
+        for (const auto& filter : json[Fields::Mqtt::Deny]) {
+            if (!filter.is_string()) {
+                continue;
+            }
+
+            _mqtt.deny.push_back(filter);
+            _log.info("{}.{}={}", Objects::Mqtt, Fields::Mqtt::Deny, static_cast<std::string>(filter));
+        }
+    }
+}
+
+void Configuration::processMetrics(const nlohmann::json& json)
+{
+    _log.debug("{}", __func__);
+
+    if (!json.is_object()) {
+        _log.warn("'{}' is missing or not an object", Objects::Metrics);
+        return;
+    }
+
+    if (
+        json.contains(Fields::Metrics::PublishIntervalMs)
+        && json[Fields::Metrics::PublishIntervalMs].is_number_unsigned()
+    ) {
+        _metrics.publishIntervalMs = json[Fields::Metrics::PublishIntervalMs];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::PublishIntervalMs, _metrics.publishIntervalMs);
+    }
+
+    if (
+        json.contains(Fields::Metrics::Streaming)
+        && json[Fields::Metrics::Streaming].is_boolean()
+    ) {
+        _metrics.streaming = json[Fields::Metrics::Streaming];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::Streaming, _metrics.streaming);
+    }
+
+    if (
+        json.contains(Fields::Metrics::Timestamps)
+        && json[Fields::Metrics::Timestamps].is_boolean()
+    ) {
+        _metrics.timestamps = json[Fields::Metrics::Timestamps];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::Timestamps, _metrics.timestamps);
+    }
+
+    if (
+        json.contains(Fields::Metrics::TtlSeconds)
+        && json[Fields::Metrics::TtlSeconds].is_number_unsigned()
+    ) {
+        _metrics.ttlSeconds = json[Fields::Metrics::TtlSeconds];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::TtlSeconds, _metrics.ttlSeconds);
+    }
+
+    if (
+        json.contains(Fields::Metrics::CoalesceIntervalMs)
+        && json[Fields::Metrics::CoalesceIntervalMs].is_number_unsigned()
+    ) {
+        _metrics.coalesceIntervalMs = json[Fields::Metrics::CoalesceIntervalMs];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::CoalesceIntervalMs, _metrics.coalesceIntervalMs);
+    }
+
+    if (
+        json.contains(Fields::Metrics::MaxSeries)
+        && json[Fields::Metrics::MaxSeries].is_number_unsigned()
+    ) {
+        _metrics.maxSeries = json[Fields::Metrics::MaxSeries];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::MaxSeries, _metrics.maxSeries);
+    }
+
+    if (
+        json.contains(Fields::Metrics::MaxMemoryBytes)
+        && json[Fields::Metrics::MaxMemoryBytes].is_number_unsigned()
+    ) {
+        _metrics.maxMemoryBytes = json[Fields::Metrics::MaxMemoryBytes];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::MaxMemoryBytes, _metrics.maxMemoryBytes);
+    }
+
+    if (
+        json.contains(Fields::Metrics::OverflowPolicy)
+        && json[Fields::Metrics::OverflowPolicy].is_string()
+    ) {
+        const std::string policy = json[Fields::Metrics::OverflowPolicy];
+
+        if (policy == "reject" || policy == "evict") {
+            _metrics.overflowPolicy = policy;
+            _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::OverflowPolicy, _metrics.overflowPolicy);
+        } else {
+            _log.warn("'{}.{}' must be \"reject\" or \"evict\"", Objects::Metrics, Fields::Metrics::OverflowPolicy);
+        }
+    }
+
+    if (
+        json.contains(Fields::Metrics::SeriesAdmissionRate)
+        && json[Fields::Metrics::SeriesAdmissionRate].is_number()
+        && json[Fields::Metrics::SeriesAdmissionRate] >= 0
+    ) {
+        _metrics.seriesAdmissionRate = json[Fields::Metrics::SeriesAdmissionRate];
+        _log.info("{}.{}={}", Objects::Metrics, Fields::Metrics::SeriesAdmissionRate, _metrics.seriesAdmissionRate);
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rules)
+        && json[Fields::Metrics::Rules].is_array()
+    ) {
+        for (const auto& rule : json[Fields::Metrics::Rules]) {
+            processMetricsRule(rule);
+        }
+    }
+}
+
+void Configuration::processMetricsRule(const nlohmann::json& json)
+{
+    _log.debug("{}", __func__);
+
+    if (
+        !json.is_object()
+        || !json.contains(Fields::Metrics::Rule::Topic)
+        || !json[Fields::Metrics::Rule::Topic].is_string()
+    ) {
+        _log.warn("'{}.{}' entry is not an object with a '{}'", Objects::Metrics, Fields::Metrics::Rules, Fields::Metrics::Rule::Topic);
+        return;
+    }
+
+    Metrics::Rule rule{
+        .topic = json[Fields::Metrics::Rule::Topic]
+    };
+
+    if (
+        json.contains(Fields::Metrics::Rule::Metric)
+        && json[Fields::Metrics::Rule::Metric].is_string()
+    ) {
+        rule.metric = json[Fields::Metrics::Rule::Metric];
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::Help)
+        && json[Fields::Metrics::Rule::Help].is_string()
+    ) {
+        rule.help = json[Fields::Metrics::Rule::Help];
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::Unit)
+        && json[Fields::Metrics::Rule::Unit].is_string()
+    ) {
+        rule.unit = json[Fields::Metrics::Rule::Unit];
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::Fields)
+        && json[Fields::Metrics::Rule::Fields].is_array()
+    ) {
+        for (const auto& field : json[Fields::Metrics::Rule::Fields]) {
+            if (!field.is_string()) {
+                continue;
+            }
+
+            rule.fields.push_back(field);
+        }
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::TtlSeconds)
+        && json[Fields::Metrics::Rule::TtlSeconds].is_number_unsigned()
+    ) {
+        rule.ttlSeconds = json[Fields::Metrics::Rule::TtlSeconds].get<unsigned>();
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::CoalesceIntervalMs)
+        && json[Fields::Metrics::Rule::CoalesceIntervalMs].is_number_unsigned()
+    ) {
+        rule.coalesceIntervalMs = json[Fields::Metrics::Rule::CoalesceIntervalMs].get<unsigned>();
+    }
+
+    std::string fields;
+
+    for (const auto& field : rule.fields) {
+        fields += fields.empty() ? field : "," + field;
+    }
+
+    _log.info(
+        "{}.{}: {}={}, {}={}, {}={}, {}={}, {}=[{}], {}={}, {}={}",
+        Objects::Metrics,
+        Fields::Metrics::Rules,
+        Fields::Metrics::Rule::Topic,
+        rule.topic,
+        Fields::Metrics::Rule::Metric,
+        rule.metric,
+        Fields::Metrics::Rule::Help,
+        rule.help,
+        Fields::Metrics::Rule::Unit,
+        rule.unit,
+        Fields::Metrics::Rule::Fields,
+        fields,
+        Fields::Metrics::Rule::TtlSeconds,
+        rule.ttlSeconds ? std::to_string(*rule.ttlSeconds) : "default",
+        Fields::Metrics::Rule::CoalesceIntervalMs,
+        rule.coalesceIntervalMs ? std::to_string(*rule.coalesceIntervalMs) : "default"
+    );
+
+    // Logged after the rule it belongs to
+    if (json.contains(Fields::Metrics::Rule::Aggregate)) {
+        processMetricsRuleAggregation(json[Fields::Metrics::Rule::Aggregate], rule);
+    }
+
+    _metrics.rules.push_back(std::move(rule));
+}
+
+void Configuration::processMetricsRuleAggregation(const nlohmann::json& json, Metrics::Rule& rule)
+{
+    _log.debug("{}", __func__);
+
+    if (!json.is_object()) {
+        _log.warn("'{}.{}.{}' is not an object", Objects::Metrics, Fields::Metrics::Rules, Fields::Metrics::Rule::Aggregate);
+        return;
+    }
+
+    auto& aggregation = rule.aggregation;
+
+    if (
+        json.contains(Fields::Metrics::Rule::Aggregation::Count)
+        && json[Fields::Metrics::Rule::Aggregation::Count].is_boolean()
+    ) {
+        aggregation.count = json[Fields::Metrics::Rule::Aggregation::Count];
+    }
+
+    if (
+        json.contains(Fields::Metrics::Rule::Aggregation::WindowSeconds)
+        && json[Fields::Metrics::Rule::Aggregation::WindowSeconds].is_number_unsigned()
+    ) {
+        aggregation.windowSeconds = json[Fields::Metrics::Rule::Aggregation::WindowSeconds];
+    }
+
+    const auto processNumbers = [&json](const char* field, std::vector<double>& numbers, std::string& list) {
+        if (
+            !json.contains(field)
+            || !json[field].is_array()
+        ) {
+            return;
+        }
+
+        for (const auto& number : json[field]) {
+            if (!number.is_number()) {
+                continue;
+            }
+
+            numbers.push_back(number);
+            list += list.empty() ? "" : ",";
+            list += std::to_string(numbers.back());
+        }
+    };
+
+    std::string buckets;
+    std::string quantiles;
+    processNumbers(Fields::Metrics::Rule::Aggregation::Buckets, aggregation.buckets, buckets);
+    processNumbers(Fields::Metrics::Rule::Aggregation::Quantiles, aggregation.quantiles, quantiles);
+
+    _log.info(
+        "{}.{}.{}: {}={}, {}={}, {}=[{}], {}=[{}]",
+        Objects::Metrics,
+        Fields::Metrics::Rules,
+        Fields::Metrics::Rule::Aggregate,
+        Fields::Metrics::Rule::Aggregation::Count,
+        aggregation.count,
+        Fields::Metrics::Rule::Aggregation::WindowSeconds,
+        aggregation.windowSeconds,
+        Fields::Metrics::Rule::Aggregation::Buckets,
+        buckets,
+        Fields::Metrics::Rule::Aggregation::Quantiles,
+        quantiles
+    );
+}
+
+void Configuration::processTaskQueue(const nlohmann::json& json)
+{
+    _log.debug("{}", __func__);
+
+    if (!json.is_object()) {
+        _log.warn("'{}' is missing or not an object", Objects::TaskQueue);
+        return;
+    }
+
+    if (
+        json.contains(Fields::TaskQueue::Workers)
+        && json[Fields::TaskQueue::Workers].is_number_unsigned()
+        && json[Fields::TaskQueue::Workers] > 0
+    ) {
+        _taskQueue.workers = json[Fields::TaskQueue::Workers];
+        _log.info("{}.{}={}", Objects::TaskQueue, Fields::TaskQueue::Workers, _taskQueue.workers);
+    }
+}
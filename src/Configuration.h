@@ -3,6 +3,7 @@
 #include "LoggerFactory.h"
 
 #include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,56 @@ public:
     struct Http
     {
         uint16_t serverPort = 8888;
+        unsigned threadPoolSize = 0;
+        bool useEpoll = false;
+        unsigned connectionLimit = 0;
+        std::size_t connectionMemoryLimit = 0;
+        unsigned listeners = 1;
+    };
+
+    struct Metrics
+    {
+        unsigned publishIntervalMs = 0;
+        bool streaming = false;
+        bool timestamps = false;
+        // Zero keeps series forever
+        unsigned ttlSeconds = 0;
+        // Zero processes every payload
+        unsigned coalesceIntervalMs = 0;
+        // Zero is unlimited
+        std::size_t maxSeries = 0;
+        std::size_t maxMemoryBytes = 0;
+        // "reject" or "evict"
+        std::string overflowPolicy = "reject";
+        double seriesAdmissionRate = 0.0;
+
+        struct Rule
+        {
+            std::string topic;
+            std::string metric;
+            std::string help;
+            std::string unit;
+            std::vector<std::string> fields;
+            std::optional<unsigned> ttlSeconds;
+            std::optional<unsigned> coalesceIntervalMs;
+
+            struct Aggregation
+            {
+                bool count = false;
+                unsigned windowSeconds = 0;
+                std::vector<double> buckets;
+                std::vector<double> quantiles;
+            };
+
+            Aggregation aggregation;
+        };
+
+        std::vector<Rule> rules;
+    };
+
+    struct TaskQueue
+    {
+        unsigned workers = 1;
     };
 
     struct Mqtt
@@ -28,6 +79,10 @@ public:
         std::vector<std::string> topics;
         std::string username;
         std::string password;
+        std::size_t messageQueueSize = 4096;
+        std::size_t messageBatchSize = 256;
+        std::vector<std::string> allow;
+        std::vector<std::string> deny;
     };
 
     const Http& http() const
@@ -40,12 +95,28 @@ public:
         return _mqtt;
     }
 
+    const Metrics& metrics() const
+    {
+        return _metrics;
+    }
+
+    const TaskQueue& taskQueue() const
+    {
+        return _taskQueue;
+    }
+
 private:
     spdlog::logger _log;
     Http _http;
     Mqtt _mqtt;
+    Metrics _metrics;
+    TaskQueue _taskQueue;
 
     void processJson(const nlohmann::json& json);
     void processHttp(const nlohmann::json& json);
     void processMqtt(const nlohmann::json& json);
+    void processMetrics(const nlohmann::json& json);
+    void processMetricsRule(const nlohmann::json& json);
+    void processMetricsRuleAggregation(const nlohmann::json& json, Metrics::Rule& rule);
+    void processTaskQueue(const nlohmann::json& json);
 };
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include "ContentNegotiation.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+namespace
+{
+    std::string_view trim(std::string_view s)
+    {
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) {
+            s.remove_prefix(1);
+        }
+
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+            s.remove_suffix(1);
+        }
+
+        return s;
+    }
+}
+
+std::vector<AcceptEntry> parseAcceptHeader(std::string_view header)
+{
+    std::vector<AcceptEntry> entries;
+
+    while (!header.empty()) {
+        const auto end = header.find(',');
+        const auto entry = header.substr(0, end);
+        const auto parametersStart = entry.find(';');
+
+        AcceptEntry acceptEntry{
+            .value = trim(entry.substr(0, parametersStart))
+        };
+
+        if (parametersStart != std::string_view::npos) {
+            acceptEntry.parameters = entry.substr(parametersStart + 1);
+
+            if (const auto q = findParameter(acceptEntry.parameters, "q")) {
+                acceptEntry.quality = 0.0;
+                std::from_chars(q->data(), q->data() + q->size(), acceptEntry.quality);
+            }
+        }
+
+        if (!acceptEntry.value.empty()) {
+            entries.push_back(acceptEntry);
+        }
+
+        if (end == std::string_view::npos) {
+            break;
+        }
+
+        header.remove_prefix(end + 1);
+    }
+
+    return entries;
+}
+
+std::optional<std::string_view> findParameter(std::string_view parameters, const std::string_view name)
+{
+    while (!parameters.empty()) {
+        const auto end = parameters.find(';');
+        const auto parameter = trim(parameters.substr(0, end));
+        const auto separator = parameter.find('=');
+
+        if (separator != std::string_view::npos && equalsIgnoreCase(trim(parameter.substr(0, separator)), name)) {
+            auto value = trim(parameter.substr(separator + 1));
+
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+
+            return value;
+        }
+
+        if (end == std::string_view::npos) {
+            break;
+        }
+
+        parameters.remove_prefix(end + 1);
+    }
+
+    return std::nullopt;
+}
+
+bool equalsIgnoreCase(const std::string_view a, const std::string_view b)
+{
+    return std::equal(
+        std::cbegin(a),
+        std::cend(a),
+        std::cbegin(b),
+        std::cend(b),
+        [](const char x, const char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        }
+    );
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Entry of a comma separated negotiation header like Accept or Accept-Encoding
+struct AcceptEntry
+{
+    // Media type or content coding, without parameters
+    std::string_view value;
+    // Parameters following the value, without the leading ';'
+    std::string_view parameters;
+    // Weight from the "q" parameter, 1 if missing
+    double quality = 1.0;
+};
+
+std::vector<AcceptEntry> parseAcceptHeader(std::string_view header);
+
+// Value of the parameter `name` in a ';' separated parameter list, quotes are removed
+std::optional<std::string_view> findParameter(std::string_view parameters, std::string_view name);
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b);
@@ -1,6 +1,8 @@
 #include "HttpServer.h"
 #include "TaskQueue.h"
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <string_view>
 
@@ -12,20 +14,109 @@ namespace
 {
     using ResponsePointer = std::unique_ptr<MHD_Response, decltype(&MHD_destroy_response)>;
 
+    constexpr auto DefaultContentType = "text/plain";
+
+    using ContentPieces = std::vector<std::shared_ptr<const std::string>>;
+
     ResponsePointer createResponse(
-        const std::string& content = {}
+        ContentPieces pieces,
+        const char* contentType = DefaultContentType
     )
     {
-        auto* response = MHD_create_response_from_buffer(
-            content.size(),
-            const_cast<char*>(content.c_str()),
-            MHD_RESPMEM_MUST_COPY
+        std::vector<MHD_IoVec> iov;
+        iov.reserve(pieces.size());
+
+        for (const auto& piece : pieces) {
+            if (piece && !piece->empty()) {
+                iov.push_back(MHD_IoVec{ piece->data(), piece->size() });
+            }
+        }
+
+        // The response keeps a reference to the pieces until MHD is done sending them
+        auto* holder = new ContentPieces{ std::move(pieces) };
+
+        auto* response = MHD_create_response_from_iovec(
+            iov.data(),
+            static_cast<unsigned int>(iov.size()),
+            [](void* cls) {
+                delete static_cast<ContentPieces*>(cls);
+            },
+            holder
         );
 
-        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+        if (!response) {
+            delete holder;
+            return ResponsePointer{ nullptr, &MHD_destroy_response };
+        }
+
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, contentType);
 
         return ResponsePointer{ response, &MHD_destroy_response };
     }
+
+    ResponsePointer createResponse(
+        std::string content = {}
+    )
+    {
+        return createResponse(ContentPieces{ std::make_shared<const std::string>(std::move(content)) });
+    }
+
+    ResponsePointer createResponse(
+        HttpServer::Request::ContentReader reader,
+        const std::size_t blockSize,
+        const char* contentType = DefaultContentType
+    )
+    {
+        using ContentReader = HttpServer::Request::ContentReader;
+
+        auto* holder = new ContentReader{ std::move(reader) };
+
+        auto* response = MHD_create_response_from_callback(
+            MHD_SIZE_UNKNOWN,
+            blockSize,
+            [](void* cls, uint64_t, char* buffer, size_t size) -> ssize_t {
+                const auto written = (*static_cast<ContentReader*>(cls))(buffer, size);
+
+                if (written == 0) {
+                    return MHD_CONTENT_READER_END_OF_STREAM;
+                }
+
+                return static_cast<ssize_t>(written);
+            },
+            holder,
+            [](void* cls) {
+                delete static_cast<ContentReader*>(cls);
+            }
+        );
+
+        if (!response) {
+            delete holder;
+            return ResponsePointer{ nullptr, &MHD_destroy_response };
+        }
+
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, contentType);
+
+        return ResponsePointer{ response, &MHD_destroy_response };
+    }
+
+    MHD_Result collectRequestHeader(
+        void* cls,
+        enum MHD_ValueKind,
+        const char* key,
+        const char* value
+    )
+    {
+        auto& headers = *static_cast<std::map<std::string, std::string>*>(cls);
+
+        std::string name{ key };
+        std::transform(std::begin(name), std::end(name), std::begin(name), [](unsigned char c) {
+            return static_cast<char>(std::tolower(c));
+        });
+
+        headers[std::move(name)] = value ? value : "";
+
+        return MHD_YES;
+    }
 }
 
 HttpServer::HttpServer(
@@ -45,7 +136,7 @@ HttpServer::HttpServer(
 
 void HttpServer::start()
 {
-    if (_mhdHandle) {
+    if (!_mhdHandles.empty()) {
         _log.warn("MHD daemon already started");
         return;
     }
@@ -89,31 +180,212 @@ void HttpServer::start()
         return MHD_NO;
     };
 
-    _mhdHandle = MHD_start_daemon(
-        MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_DEBUG,
-        _config.port,
-        accessPolicyCallback,
-        this,
-        defaultAccessHandler,
-        this,
-        MHD_OPTION_END
-    );
+    static const auto requestCompletedCallback = [](
+        void* cls,
+        struct MHD_Connection*,
+        void** conCls,
+        enum MHD_RequestTerminationCode
+    ) {
+        if (auto* self = reinterpret_cast<HttpServer*>(cls)) {
+            self->onMhdRequestCompleted(conCls);
+        }
+    };
+
+    auto flags = MHD_ALLOW_SUSPEND_RESUME | MHD_USE_DEBUG;
+    flags |= _config.useEpoll ? MHD_USE_EPOLL_INTERNAL_THREAD : MHD_USE_INTERNAL_POLLING_THREAD;
+
+    std::vector<MHD_OptionItem> options{
+        {
+            MHD_OPTION_NOTIFY_COMPLETED,
+            reinterpret_cast<intptr_t>(static_cast<MHD_RequestCompletedCallback>(requestCompletedCallback)),
+            this
+        }
+    };
+
+    if (_config.threadPoolSize > 0) {
+        options.push_back({ MHD_OPTION_THREAD_POOL_SIZE, _config.threadPoolSize, nullptr });
+    }
 
-    if (!_mhdHandle) {
-        _log.warn("Can't start MHD daemon");
+    if (_config.connectionLimit > 0) {
+        options.push_back({ MHD_OPTION_CONNECTION_LIMIT, _config.connectionLimit, nullptr });
+    }
+
+    if (_config.connectionMemoryLimit > 0) {
+        options.push_back({
+            MHD_OPTION_CONNECTION_MEMORY_LIMIT,
+            static_cast<intptr_t>(_config.connectionMemoryLimit),
+            nullptr
+        });
+    }
+
+    if (_config.listeners > 1) {
+        options.push_back({ MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, nullptr });
+    }
+
+    options.push_back({ MHD_OPTION_END, 0, nullptr });
+
+    for (auto i = 0u; i < std::max(_config.listeners, 1u); ++i) {
+        auto* handle = MHD_start_daemon(
+            flags,
+            _config.port,
+            accessPolicyCallback,
+            this,
+            defaultAccessHandler,
+            this,
+            MHD_OPTION_ARRAY,
+            options.data(),
+            MHD_OPTION_END
+        );
+
+        if (!handle) {
+            _log.warn("Can't start MHD daemon: listener={}", i);
+            continue;
+        }
+
+        _mhdHandles.push_back(handle);
     }
 }
 
 void HttpServer::stop()
 {
-    if (!_mhdHandle) {
+    if (_mhdHandles.empty()) {
         _log.warn("MHD daemon already stopped");
         return;
     }
 
     _log.debug("Stopping MHD daemon");
 
-    MHD_stop_daemon(_mhdHandle);
+    // Suspended connections must be resumed before stopping the daemon
+    decltype(_suspendedRequests) suspendedRequests;
+
+    {
+        std::lock_guard lock{ _suspendedRequestsMutex };
+        suspendedRequests = _suspendedRequests;
+    }
+
+    for (const auto& request : suspendedRequests) {
+        _log.debug("Aborting suspended request: endpoint={}", request->endpoint());
+        onRequestTimeout(*request);
+    }
+
+    for (auto* handle : _mhdHandles) {
+        MHD_stop_daemon(handle);
+    }
+
+    _mhdHandles.clear();
+}
+
+void HttpServer::Request::finish()
+{
+    std::lock_guard lock{ _mutex };
+
+    if (_finished) {
+        return;
+    }
+
+    _finished = true;
+
+    if (_suspended) {
+        _server.resume(*this);
+    }
+}
+
+void HttpServer::suspend(Request& request)
+{
+    // Called with the request locked
+    request._suspended = true;
+
+    {
+        std::lock_guard lock{ _suspendedRequestsMutex };
+        _suspendedRequests.insert(request.shared_from_this());
+    }
+
+    request._timeoutTimer = _taskQueue.pushDelayed(
+        "HttpServerRequestTimeout",
+        [this, weakRequest = request.weak_from_this()](auto&) {
+            if (const auto request = weakRequest.lock()) {
+                onRequestTimeout(*request);
+            }
+        },
+        _config.requestTimeout,
+        0,
+        TaskQueue::Unordered
+    );
+
+    MHD_suspend_connection(request._connection);
+}
+
+void HttpServer::resume(Request& request)
+{
+    // Called with the request locked
+    request._suspended = false;
+
+    if (request._timeoutTimer) {
+        _taskQueue.cancel(request._timeoutTimer);
+        request._timeoutTimer = 0;
+    }
+
+    {
+        std::lock_guard lock{ _suspendedRequestsMutex };
+        _suspendedRequests.erase(request.shared_from_this());
+    }
+
+    // MHD calls the access handler again which queues the response
+    MHD_resume_connection(request._connection);
+}
+
+void HttpServer::onRequestTimeout(Request& request)
+{
+    std::lock_guard lock{ request._mutex };
+
+    if (request._finished) {
+        return;
+    }
+
+    _log.warn("Request handler timed out: endpoint={}", request.endpoint());
+
+    // The handler may still be writing the response, it's ignored from now on
+    request._timedOut = true;
+    request._finished = true;
+
+    if (request._suspended) {
+        resume(request);
+    }
+}
+
+void HttpServer::queueResponse(Request& request)
+{
+    if (request._timedOut) {
+        MHD_queue_response(
+            request._connection,
+            MHD_HTTP_INTERNAL_SERVER_ERROR,
+            createResponse("Request handler timed out").get()
+        );
+
+        return;
+    }
+
+    auto& headers = request._responseHeaders;
+    const auto contentTypeIt = headers.find(MHD_HTTP_HEADER_CONTENT_TYPE);
+    const auto* contentType = contentTypeIt != std::end(headers)
+        ? contentTypeIt->second.c_str()
+        : DefaultContentType;
+
+    auto response = request._responseReader
+        ? createResponse(std::move(request._responseReader), _config.streamBlockSize, contentType)
+        : createResponse(std::move(request._responseContent), contentType);
+
+    for (const auto& [key, value] : headers) {
+        if (key != MHD_HTTP_HEADER_CONTENT_TYPE) {
+            MHD_add_response_header(response.get(), key.c_str(), value.c_str());
+        }
+    }
+
+    MHD_queue_response(
+        request._connection,
+        request._responseCode,
+        response.get()
+    );
 }
 
 MHD_Result HttpServer::onMhdAccessPolicy(
@@ -157,6 +429,16 @@ MHD_Result HttpServer::onMhdDefaultAccessHandler(
     size_t *uploadDataSize,
     void** conCls
 ) {
+    if (*conCls) {
+        // Resumed after the request handler finished the request
+        auto& request = **static_cast<std::shared_ptr<Request>*>(*conCls);
+
+        std::lock_guard lock{ request._mutex };
+        queueResponse(request);
+
+        return MHD_YES;
+    }
+
     _log.debug("onMhdDefaultAccessHandler: url={}, method={}, vesion={}", url, method, version);
 
     const std::string_view vUrl{ url };
@@ -207,43 +489,51 @@ MHD_Result HttpServer::onMhdDefaultAccessHandler(
     }
 
     decltype(Request::_requestHeaders) requestHeaders;
+    MHD_get_connection_values(connection, MHD_HEADER_KIND, &collectRequestHeader, &requestHeaders);
 
-    Request request{
-        url,
-        std::move(requestHeaders)
+    auto request = std::shared_ptr<Request>{
+        new Request{
+            *this,
+            connection,
+            url,
+            std::move(requestHeaders)
+        }
     };
 
-    auto requestFuture = request._promise.get_future();
+    // Owned by the connection until onMhdRequestCompleted()
+    *conCls = new std::shared_ptr<Request>{ request };
 
-    _taskQueue.push("HttpServerRequestHandler", [this, &request](auto&) {
-        _requestHandler(request);
-    });
+    // Called directly on the server's thread instead of queuing the request,
+    // so the response doesn't depend on the amount of pending work
+    _requestHandler(*request);
 
-    if (const auto status = requestFuture.wait_for(5s); status == std::future_status::timeout) {
-        _log.warn("Request handler timed out");
-
-        MHD_queue_response(
-            connection,
-            MHD_HTTP_INTERNAL_SERVER_ERROR,
-            createResponse("Request handler timed out").get()
-        );
+    std::lock_guard lock{ request->_mutex };
 
-        return MHD_YES;
+    if (request->_finished) {
+        queueResponse(*request);
+    } else {
+        // Finished later from another thread, don't block the server's thread until then
+        suspend(*request);
     }
 
-    MHD_queue_response(
-        connection,
-        request._responseCode,
-        createResponse(request._responseContent).get()
-    );
-
     return MHD_YES;
 }
 
+void HttpServer::onMhdRequestCompleted(void** conCls)
+{
+    delete static_cast<std::shared_ptr<Request>*>(*conCls);
+    *conCls = nullptr;
+}
+
 std::string toString(const HttpServer::Configuration& config)
 {
     return fmt::format(
-        "{{port={}}}",
-        config.port
+        "{{port={},threadPoolSize={},useEpoll={},connectionLimit={},connectionMemoryLimit={},listeners={}}}",
+        config.port,
+        config.threadPoolSize,
+        config.useEpoll,
+        config.connectionLimit,
+        config.connectionMemoryLimit,
+        config.listeners
     );
 }
\ No newline at end of file
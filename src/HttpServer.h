@@ -1,18 +1,20 @@
 #pragma once
 
 #include "LoggerFactory.h"
+#include "TaskQueue.h"
 
+#include <chrono>
 #include <cstdint>
 #include <functional>
-#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <microhttpd.h>
 
-class TaskQueue;
-
 class HttpServer
 {
 public:
@@ -22,8 +24,19 @@ public:
         std::vector<std::string> allowedEndpoints{
             "/metrics"
         };
+        std::chrono::milliseconds requestTimeout = std::chrono::seconds{ 5 };
+        // Zero runs a single polling thread per listener
+        unsigned threadPoolSize = 0;
+        bool useEpoll = false;
+        // Zero keeps MHD's defaults
+        unsigned connectionLimit = 0;
+        std::size_t connectionMemoryLimit = 0;
+        // Multiple listeners bind the same port with SO_REUSEPORT and let the kernel balance between them
+        unsigned listeners = 1;
+        // Size of the buffer MHD fills from a streamed response at a time
+        std::size_t streamBlockSize = 32 * 1024;
     };
-    
+
     HttpServer(
         const LoggerFactory& loggerFactory,
         TaskQueue& taskQueue,
@@ -33,7 +46,8 @@ public:
     void start();
     void stop();
 
-    struct Request
+    // Handlers finishing the request asynchronously must keep it alive with shared_from_this()
+    struct Request : std::enable_shared_from_this<Request>
     {
         const auto& endpoint() const
         {
@@ -52,38 +66,74 @@ public:
 
         void setResponseContent(std::string content)
         {
-            _responseContent = std::move(content);
+            _responseContent = { std::make_shared<const std::string>(std::move(content)) };
         }
 
-        void setResponseCode(const int code)
+        // Shared content is sent without copying, it must not be modified afterwards
+        void setResponseContent(std::shared_ptr<const std::string> content)
         {
-            _responseCode = code;
+            _responseContent = { std::move(content) };
+        }
+
+        // Pieces of shared content, sent one after the other without joining or copying them
+        void setResponseContent(std::vector<std::shared_ptr<const std::string>> pieces)
+        {
+            _responseContent = std::move(pieces);
+        }
+
+        // Produces the content incrementally: writes at most `size` bytes to `buffer`
+        // and returns their number, zero ends the content. Called on the server's threads.
+        using ContentReader = std::function<std::size_t (char* buffer, std::size_t size)>;
+
+        // The content is sent with chunked transfer encoding
+        void setResponseContent(ContentReader reader)
+        {
+            _responseReader = std::move(reader);
         }
 
-        void finish()
+        void setResponseCode(const int code)
         {
-            _promise.set_value();
+            _responseCode = code;
         }
 
+        // Sends the response, can be called from any thread.
+        // The response must not be modified afterwards.
+        void finish();
+
     private:
         friend class HttpServer;
 
         Request(
+            HttpServer& server,
+            struct MHD_Connection* connection,
             std::string endpoint,
             std::map<std::string, std::string>&& requestHeaders = {}
         )
-            : _endpoint{ std::move(endpoint) }
+            : _server{ server }
+            , _connection{ connection }
+            , _endpoint{ std::move(endpoint) }
             , _requestHeaders{ std::move(requestHeaders) }
         {}
 
+        HttpServer& _server;
+        struct MHD_Connection* const _connection;
         std::string _endpoint;
+        // Header names are lowercase
         std::map<std::string, std::string> _requestHeaders;
-        std::promise<void> _promise;
         std::map<std::string, std::string> _responseHeaders;
-        std::string _responseContent;
+        std::vector<std::shared_ptr<const std::string>> _responseContent;
+        ContentReader _responseReader;
         int _responseCode = 200;
+
+        std::mutex _mutex;
+        bool _finished = false;
+        bool _suspended = false;
+        bool _timedOut = false;
+        TaskQueue::TimerHandle _timeoutTimer = 0;
     };
 
+    // Called on one of the server's threads, so it must be thread-safe and must not block.
+    // The request can be finished later from any thread.
     using RequestHandler = std::function<void (Request&)>;
 
     void setRequestHandler(RequestHandler&& handler)
@@ -95,9 +145,17 @@ private:
     spdlog::logger _log;
     TaskQueue& _taskQueue;
     const Configuration _config;
-    struct MHD_Daemon* _mhdHandle = nullptr;
+    std::vector<struct MHD_Daemon*> _mhdHandles;
     RequestHandler _requestHandler;
 
+    std::mutex _suspendedRequestsMutex;
+    std::unordered_set<std::shared_ptr<Request>> _suspendedRequests;
+
+    void suspend(Request& request);
+    void resume(Request& request);
+    void onRequestTimeout(Request& request);
+    void queueResponse(Request& request);
+
     MHD_Result onMhdAccessPolicy(
         const struct sockaddr* addr,
         socklen_t addrlen
@@ -112,6 +170,8 @@ private:
         size_t *uploadDataSize,
         void** conCls
     );
+
+    void onMhdRequestCompleted(void** conCls);
 };
 
-std::string toString(const HttpServer::Configuration& config);
\ No newline at end of file
+std::string toString(const HttpServer::Configuration& config);
@@ -0,0 +1,124 @@
+#include "Instrumentation.h"
+
+#include <algorithm>
+
+namespace Instrumentation
+{
+    std::size_t threadShard()
+    {
+        static std::atomic_size_t nextShard{ 0 };
+        thread_local const auto shard = nextShard.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+
+        return shard;
+    }
+
+    void Counter::add(const std::uint64_t value)
+    {
+        _shards[threadShard()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Counter::value() const
+    {
+        std::uint64_t sum = 0;
+
+        for (const auto& shard : _shards) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+
+        return sum;
+    }
+
+    Histogram::Histogram(const std::span<const std::uint64_t> bounds)
+        : _boundCount{ std::min(bounds.size(), MaxBuckets) }
+    {
+        std::copy_n(std::begin(bounds), _boundCount, std::begin(_bounds));
+    }
+
+    void Histogram::observe(const std::uint64_t value, const std::uint64_t count)
+    {
+        // Upper bounds are inclusive
+        const auto bucket = std::lower_bound(
+            std::begin(_bounds),
+            std::begin(_bounds) + _boundCount,
+            value
+        ) - std::begin(_bounds);
+
+        auto& shard = _shards[threadShard()];
+        shard.counts[bucket].fetch_add(count, std::memory_order_relaxed);
+        shard.sum.fetch_add(value * count, std::memory_order_relaxed);
+    }
+
+    Histogram::Snapshot Histogram::snapshot() const
+    {
+        Snapshot snapshot;
+        std::array<std::uint64_t, MaxBuckets + 1> counts{};
+
+        for (const auto& shard : _shards) {
+            for (auto i = 0u; i <= _boundCount; ++i) {
+                counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+            }
+
+            snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        }
+
+        snapshot.buckets.reserve(_boundCount);
+
+        for (auto i = 0u; i < _boundCount; ++i) {
+            snapshot.count += counts[i];
+            snapshot.buckets.emplace_back(_bounds[i], snapshot.count);
+        }
+
+        snapshot.count += counts[_boundCount];
+
+        return snapshot;
+    }
+
+    HistogramTable::HistogramTable(const std::span<const std::uint64_t> bounds)
+        : _overflow{ bounds }
+    {
+        // Allocated up front, so claiming a slot never allocates
+        _histograms.reserve(Capacity);
+
+        for (auto i = 0u; i < Capacity; ++i) {
+            _histograms.push_back(std::make_unique<Histogram>(bounds));
+        }
+    }
+
+    Histogram& HistogramTable::operator[](const char* key)
+    {
+        // Compared by content, the same literal may have a different address in each translation unit.
+        // Open addressing with linear probing, slots are never freed, so equal keys end up in the same one.
+        const std::string_view name{ key };
+        const auto start = std::hash<std::string_view>{}(name) % Capacity;
+
+        for (auto i = 0u; i < Capacity; ++i) {
+            const auto index = (start + i) % Capacity;
+            auto current = _keys[index].load(std::memory_order_acquire);
+
+            if (!current && _keys[index].compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                return *_histograms[index];
+            }
+
+            // Set by the exchange if another thread claimed the slot first
+            if (name == current) {
+                return *_histograms[index];
+            }
+        }
+
+        return _overflow;
+    }
+
+    void HistogramTable::forEach(const std::function<void (std::string_view key, const Histogram& histogram)>& visitor) const
+    {
+        for (auto i = 0u; i < Capacity; ++i) {
+            if (const auto* key = _keys[i].load(std::memory_order_acquire)) {
+                visitor(key, *_histograms[i]);
+            }
+        }
+    }
+
+    const Histogram& HistogramTable::overflow() const
+    {
+        return _overflow;
+    }
+}
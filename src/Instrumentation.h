@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Lock-free instruments for the metrics of the exporter itself. Every thread updates a shard
+// of its own with relaxed atomics, so updates don't contend. Readers add the shards up.
+namespace Instrumentation
+{
+    inline constexpr std::size_t ShardCount = 8;
+
+    // Shard of the calling thread, assigned round-robin on first use
+    std::size_t threadShard();
+
+    class Counter
+    {
+    public:
+        void add(std::uint64_t value = 1);
+
+        // Sum of the shards, can be called from any thread
+        std::uint64_t value() const;
+
+    private:
+        // Padded to a cache line, so threads don't write to the same one
+        struct alignas(64) Shard
+        {
+            std::atomic_uint64_t value{ 0 };
+        };
+
+        std::array<Shard, ShardCount> _shards;
+    };
+
+    // Counts observations in fixed buckets. Values are integers in the unit of the bounds,
+    // e.g. microseconds or bytes.
+    class Histogram
+    {
+    public:
+        static constexpr std::size_t MaxBuckets = 15;
+
+        // Ascending upper bounds of the buckets, the +Inf one is implicit. Extra bounds are ignored.
+        explicit Histogram(std::span<const std::uint64_t> bounds);
+
+        // `count` observations of the same value, e.g. of a sample standing in for several
+        void observe(std::uint64_t value, std::uint64_t count = 1);
+
+        struct Snapshot
+        {
+            std::uint64_t count = 0;
+            std::uint64_t sum = 0;
+            // Upper bound and cumulative count of each bucket but the +Inf one
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> buckets;
+        };
+
+        // Sum of the shards, can be called from any thread. Concurrent observations
+        // may be partially included.
+        Snapshot snapshot() const;
+
+    private:
+        std::array<std::uint64_t, MaxBuckets> _bounds{};
+        std::size_t _boundCount = 0;
+
+        struct alignas(64) Shard
+        {
+            // The last one is the +Inf bucket
+            std::array<std::atomic_uint64_t, MaxBuckets + 1> counts{};
+            std::atomic_uint64_t sum{ 0 };
+        };
+
+        std::array<Shard, ShardCount> _shards;
+    };
+
+    // Histograms keyed by the content of a string with static storage, e.g. a task id.
+    // Lookups and insertions are lock-free. Keys beyond the capacity share the overflow histogram.
+    class HistogramTable
+    {
+    public:
+        static constexpr std::size_t Capacity = 64;
+
+        explicit HistogramTable(std::span<const std::uint64_t> bounds);
+
+        Histogram& operator[](const char* key);
+
+        // Calls `visitor` for each key seen so far, can be called from any thread
+        void forEach(const std::function<void (std::string_view key, const Histogram& histogram)>& visitor) const;
+
+        // Observations of the keys which didn't fit
+        const Histogram& overflow() const;
+
+    private:
+        // Null if the slot is free, claimed once and never released
+        std::array<std::atomic<const char*>, Capacity> _keys{};
+        std::vector<std::unique_ptr<Histogram>> _histograms;
+        Histogram _overflow;
+    };
+}
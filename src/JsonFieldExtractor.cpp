@@ -0,0 +1,199 @@
+#include "JsonFieldExtractor.h"
+#include "MetricValue.h"
+
+#include <nlohmann/json.hpp>
+
+class JsonFieldExtractorSax final : public nlohmann::json_sax<nlohmann::json>
+{
+public:
+    JsonFieldExtractorSax(
+        const JsonFieldExtractor& extractor,
+        std::span<std::optional<double>> values
+    )
+        : _extractor{ extractor }
+        , _values{ values }
+    {}
+
+    std::size_t found() const
+    {
+        return _found;
+    }
+
+    bool null() override
+    {
+        return skip();
+    }
+
+    bool boolean(const bool value) override
+    {
+        return store(value ? 1.0 : 0.0);
+    }
+
+    bool number_integer(const number_integer_t value) override
+    {
+        return store(static_cast<double>(value));
+    }
+
+    bool number_unsigned(const number_unsigned_t value) override
+    {
+        return store(static_cast<double>(value));
+    }
+
+    bool number_float(const number_float_t value, const string_t&) override
+    {
+        return store(value);
+    }
+
+    bool string(string_t& value) override
+    {
+        if (const auto number = parseMetricValue(value)) {
+            return store(*number);
+        }
+
+        return skip();
+    }
+
+    bool binary(binary_t&) override
+    {
+        return skip();
+    }
+
+    bool start_object(std::size_t) override
+    {
+        // Objects not on any path are still walked, their keys just never match
+        _stack.push_back(_pending);
+        _pending = JsonFieldExtractor::NoNode;
+        return true;
+    }
+
+    bool key(string_t& key) override
+    {
+        const auto parent = _stack.back();
+        _pending = parent != JsonFieldExtractor::NoNode
+            ? _extractor.child(parent, key)
+            : JsonFieldExtractor::NoNode;
+        return true;
+    }
+
+    bool end_object() override
+    {
+        _stack.pop_back();
+        return true;
+    }
+
+    bool start_array(std::size_t) override
+    {
+        // Array elements can't be addressed by a path
+        _stack.push_back(JsonFieldExtractor::NoNode);
+        _pending = JsonFieldExtractor::NoNode;
+        return true;
+    }
+
+    bool end_array() override
+    {
+        _stack.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override
+    {
+        return false;
+    }
+
+private:
+    const JsonFieldExtractor& _extractor;
+    std::span<std::optional<double>> _values;
+    std::size_t _found = 0;
+
+    // Node of each enclosing object, NoNode if it's not on any path
+    std::vector<std::uint32_t> _stack;
+    // Node of the value following the last key, the root for the top-level value
+    std::uint32_t _pending = 0;
+
+    bool store(const double value)
+    {
+        if (_pending == JsonFieldExtractor::NoNode) {
+            return true;
+        }
+
+        const auto field = _extractor._nodes[_pending].field;
+        _pending = JsonFieldExtractor::NoNode;
+
+        if (field == JsonFieldExtractor::NoField) {
+            return true;
+        }
+
+        if (!_values[field]) {
+            ++_found;
+        }
+
+        _values[field] = value;
+
+        // Returning false stops the parser once everything was found
+        return _found < _extractor.fieldCount();
+    }
+
+    bool skip()
+    {
+        _pending = JsonFieldExtractor::NoNode;
+        return true;
+    }
+};
+
+JsonFieldExtractor::JsonFieldExtractor(const std::vector<std::string>& paths)
+    : _nodes(1)
+{
+    for (const auto& path : paths) {
+        std::uint32_t node = 0;
+        std::string_view remaining{ path };
+
+        while (true) {
+            const auto end = remaining.find('.');
+            const auto key = remaining.substr(0, end);
+
+            auto next = child(node, key);
+
+            if (next == NoNode) {
+                next = static_cast<std::uint32_t>(_nodes.size());
+                _nodes[node].children.emplace_back(std::string{ key }, next);
+                _nodes.emplace_back();
+            }
+
+            node = next;
+
+            if (end == std::string_view::npos) {
+                break;
+            }
+
+            remaining.remove_prefix(end + 1);
+        }
+
+        _nodes[node].field = static_cast<std::uint32_t>(_fieldCount++);
+    }
+}
+
+std::size_t JsonFieldExtractor::extract(
+    const std::string_view payload,
+    std::span<std::optional<double>> values
+) const {
+    if (values.size() < _fieldCount) {
+        return 0;
+    }
+
+    JsonFieldExtractorSax sax{ *this, values };
+
+    nlohmann::json::sax_parse(std::begin(payload), std::end(payload), &sax);
+
+    return sax.found();
+}
+
+std::uint32_t JsonFieldExtractor::child(const std::uint32_t node, const std::string_view key) const
+{
+    for (const auto& [childKey, index] : _nodes[node].children) {
+        if (childKey == key) {
+            return index;
+        }
+    }
+
+    return NoNode;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Extracts numeric fields from JSON payloads. The field paths are compiled into
+// a tree once, so extracting is a single SAX pass without building a DOM, and
+// parsing stops as soon as all fields are found.
+class JsonFieldExtractor final
+{
+public:
+    // Nested fields are separated by dots, e.g. "ENERGY.Power". Paths must be unique,
+    // the field index of a path is its index in `paths`.
+    explicit JsonFieldExtractor(const std::vector<std::string>& paths);
+
+    std::size_t fieldCount() const
+    {
+        return _fieldCount;
+    }
+
+    // Stores the value of field i into values[i], fields not found are left untouched.
+    // Booleans are 1 or 0, strings are parsed as numbers. Returns the number of fields found.
+    std::size_t extract(std::string_view payload, std::span<std::optional<double>> values) const;
+
+private:
+    friend class JsonFieldExtractorSax;
+
+    static constexpr std::uint32_t NoNode = UINT32_MAX;
+    static constexpr std::uint32_t NoField = UINT32_MAX;
+
+    struct Node
+    {
+        // Few keys per object, a linear search beats hashing
+        std::vector<std::pair<std::string, std::uint32_t>> children;
+        std::uint32_t field = NoField;
+    };
+
+    // The root is at index zero
+    std::vector<Node> _nodes;
+    std::size_t _fieldCount = 0;
+
+    std::uint32_t child(std::uint32_t node, std::string_view key) const;
+};
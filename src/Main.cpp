@@ -1,13 +1,22 @@
+#include "Compression.h"
 #include "Configuration.h"
 #include "HttpServer.h"
+#include "Instrumentation.h"
 #include "LoggerFactory.h"
 #include "MetricsAccumulator.h"
+#include "MetricsFormat.h"
 #include "MetricsPresenter.h"
 #include "MqttClient.h"
 #include "TaskQueue.h"
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <csignal>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
 
 namespace
 {
@@ -19,6 +28,101 @@ namespace
     std::unique_ptr<MetricsAccumulator> metricsAccumulator;
     std::unique_ptr<MetricsPresenter> metricsPresenter;
     bool shutdownInitiated = false;
+
+    // Microseconds
+    constexpr std::array<std::uint64_t, 10> RenderDurationBounds{
+        100, 500, 1'000, 5'000, 10'000, 50'000, 100'000, 500'000, 1'000'000, 5'000'000
+    };
+    // Bytes
+    constexpr std::array<std::uint64_t, 8> ResponseSizeBounds{
+        1'000, 10'000, 100'000, 1'000'000, 5'000'000, 10'000'000, 50'000'000, 100'000'000
+    };
+
+    // Updated by the HTTP threads, read when collecting
+    Instrumentation::Histogram renderDurations{ RenderDurationBounds };
+    Instrumentation::Histogram responseSizes{ ResponseSizeBounds };
+
+    void observeResponse(const std::chrono::steady_clock::time_point start, const std::size_t size)
+    {
+        const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start
+        );
+
+        renderDurations.observe(static_cast<std::uint64_t>(duration.count()));
+        responseSizes.observe(size);
+    }
+
+    // Adds the histogram with its bounds and sum divided by `divisor`, e.g. to convert microseconds to seconds
+    void addHistogram(
+        MetricsPresenter::Collection& collection,
+        const std::string_view name,
+        const Instrumentation::Histogram& histogram,
+        const double divisor,
+        MetricsAccumulator::Labels labels = {}
+    ) {
+        const auto snapshot = histogram.snapshot();
+
+        MetricsAccumulator::Distribution distribution{
+            .count = snapshot.count,
+            .sum = static_cast<double>(snapshot.sum) / divisor
+        };
+
+        for (const auto& [bound, count] : snapshot.buckets) {
+            distribution.points.emplace_back(static_cast<double>(bound) / divisor, static_cast<double>(count));
+        }
+
+        collection.add(name, std::move(distribution), MetricsAccumulator::MetricType::Histogram, std::move(labels));
+    }
+
+    // Statistics of the exporter itself, read from the components' thread-safe instruments on every scrape
+    void collectStatistics(MetricsPresenter::Collection& collection)
+    {
+        using MetricType = MetricsAccumulator::MetricType;
+
+        const auto statistics = mqttClient->statistics();
+        const auto series = metricsAccumulator->statistics();
+
+        const auto addCounter = [&collection](
+            const std::string_view name,
+            const std::uint64_t value,
+            MetricsAccumulator::Labels labels = {}
+        ) {
+            collection.add(name, static_cast<double>(value), MetricType::Counter, std::move(labels));
+        };
+
+        addCounter("mqtt_exporter_messages_received_total", statistics.receivedMessages);
+        addCounter("mqtt_exporter_messages_dropped_total", statistics.filteredMessages, { { "reason", "filtered" } });
+        addCounter("mqtt_exporter_messages_dropped_total", statistics.droppedMessages, { { "reason", "queue_full" } });
+        addCounter("mqtt_exporter_messages_dropped_total", series.coalescedPayloads, { { "reason", "coalesced" } });
+        addCounter("mqtt_exporter_messages_dropped_total", series.invalidPayloads, { { "reason", "invalid" } });
+        addCounter("mqtt_exporter_messages_processed_total", series.processedPayloads);
+        addCounter("mqtt_exporter_mqtt_reconnects_total", statistics.reconnects);
+
+        collection.add("mqtt_exporter_series", static_cast<double>(series.series));
+        collection.add("mqtt_exporter_series_memory_bytes", static_cast<double>(series.memory));
+        addCounter("mqtt_exporter_series_rejected_total", series.rejectedSeries);
+        addCounter("mqtt_exporter_series_evicted_total", series.evictedSeries);
+        addCounter("mqtt_exporter_series_expired_total", series.expiredSeries);
+
+        collection.add("mqtt_exporter_task_queue_depth", static_cast<double>(taskQueue->queueDepth()));
+        collection.add("mqtt_exporter_task_wait_queue_depth", static_cast<double>(taskQueue->waitQueueDepth()));
+
+        const auto& taskDurations = taskQueue->taskDurations();
+
+        taskDurations.forEach([&collection](const std::string_view task, const Instrumentation::Histogram& histogram) {
+            addHistogram(collection, "mqtt_exporter_task_duration_seconds", histogram, 1e6, { { "task", std::string{ task } } });
+        });
+
+        // Without a task label, so it can't be mistaken for a task
+        if (taskDurations.overflow().snapshot().count > 0) {
+            addHistogram(collection, "mqtt_exporter_task_duration_seconds", taskDurations.overflow(), 1e6);
+        }
+
+        addHistogram(collection, "mqtt_exporter_render_duration_seconds", renderDurations, 1e6);
+        addHistogram(collection, "mqtt_exporter_response_size_bytes", responseSizes, 1.0);
+        addHistogram(collection, "mqtt_exporter_ingest_latency_seconds", metricsAccumulator->ingestLatencies(), 1e6);
+        addHistogram(collection, "mqtt_exporter_visibility_latency_seconds", metricsAccumulator->visibilityLatencies(), 1e6);
+    }
 }
 
 void shutdown()
@@ -38,6 +142,12 @@ void shutdown()
         taskQueue->shutdown();
     }, 1);
 
+    if (metricsAccumulator) {
+        taskQueue->push("MetricsAccumulatorStop", [](auto&) {
+            metricsAccumulator->stop();
+        });
+    }
+
     if (httpServer) {
         taskQueue->push("HttpServerStop", [](auto&) {
             httpServer->stop();
@@ -74,13 +184,21 @@ int main()
         return 1;
     }
 
-    taskQueue = std::make_unique<TaskQueue>(loggerFactory);
+    taskQueue = std::make_unique<TaskQueue>(
+        loggerFactory,
+        configuration.taskQueue().workers
+    );
 
     httpServer = std::make_unique<HttpServer>(
         loggerFactory,
         *taskQueue,
         HttpServer::Configuration{
-            .port = configuration.http().serverPort
+            .port = configuration.http().serverPort,
+            .threadPoolSize = configuration.http().threadPoolSize,
+            .useEpoll = configuration.http().useEpoll,
+            .connectionLimit = configuration.http().connectionLimit,
+            .connectionMemoryLimit = configuration.http().connectionMemoryLimit,
+            .listeners = configuration.http().listeners
         }
     );
 
@@ -92,40 +210,144 @@ int main()
             .brokerAddress = configuration.mqtt().brokerAddress,
             .brokerPort = configuration.mqtt().brokerPort,
             .username = configuration.mqtt().username,
-            .password = configuration.mqtt().password
+            .password = configuration.mqtt().password,
+            .messageQueueSize = configuration.mqtt().messageQueueSize,
+            .messageBatchSize = configuration.mqtt().messageBatchSize,
+            .allow = configuration.mqtt().allow,
+            .deny = configuration.mqtt().deny
         }
     );
 
+    MetricsAccumulator::Configuration metricsConfig{
+        .publishInterval = std::chrono::milliseconds{ configuration.metrics().publishIntervalMs },
+        .ttl = std::chrono::seconds{ configuration.metrics().ttlSeconds },
+        .coalesceInterval = std::chrono::milliseconds{ configuration.metrics().coalesceIntervalMs },
+        .maxSeries = configuration.metrics().maxSeries,
+        .maxMemory = configuration.metrics().maxMemoryBytes,
+        .overflowPolicy = configuration.metrics().overflowPolicy == "evict"
+            ? MetricsAccumulator::Configuration::OverflowPolicy::Evict
+            : MetricsAccumulator::Configuration::OverflowPolicy::Reject,
+        .seriesAdmissionRate = configuration.metrics().seriesAdmissionRate
+    };
+
+    for (const auto& rule : configuration.metrics().rules) {
+        metricsConfig.rules.push_back(
+            MetricsAccumulator::Configuration::Rule{
+                .topic = rule.topic,
+                .metric = rule.metric,
+                .help = rule.help,
+                .unit = rule.unit,
+                .fields = rule.fields,
+                .ttl = rule.ttlSeconds
+                    ? std::optional{ std::chrono::seconds{ *rule.ttlSeconds } }
+                    : std::nullopt,
+                .coalesceInterval = rule.coalesceIntervalMs
+                    ? std::optional{ std::chrono::milliseconds{ *rule.coalesceIntervalMs } }
+                    : std::nullopt,
+                .aggregation = {
+                    .count = rule.aggregation.count,
+                    .window = std::chrono::seconds{ rule.aggregation.windowSeconds },
+                    .buckets = rule.aggregation.buckets,
+                    .quantiles = rule.aggregation.quantiles
+                }
+            }
+        );
+    }
+
     metricsAccumulator = std::make_unique<MetricsAccumulator>(
-        loggerFactory
+        loggerFactory,
+        *taskQueue,
+        std::move(metricsConfig)
     );
 
     metricsPresenter = std::make_unique<MetricsPresenter>(
-        *metricsAccumulator
+        *metricsAccumulator,
+        MetricsPresenter::Configuration{
+            .timestamps = configuration.metrics().timestamps
+        }
     );
 
+    metricsPresenter->setCollector(collectStatistics);
+
     for (const auto& topic : configuration.mqtt().topics) {
         mqttClient->subscribe(topic);
     }
 
-    mqttClient->setMessageReceivedHandler([](const std::string& topic, const std::vector<uint8_t>& payload) {
+    mqttClient->setMessageReceivedHandler([](
+        const std::string_view topic,
+        const std::span<const uint8_t> payload,
+        const std::chrono::steady_clock::time_point received
+    ) {
         if (!metricsAccumulator) {
             return;
         }
 
         metricsAccumulator->add(
             topic,
-            std::string{
+            std::string_view{
                 reinterpret_cast<const char*>(payload.data()),
                 payload.size()
-            }
+            },
+            received
         );
     });
 
-    httpServer->setRequestHandler([](HttpServer::Request& request) {
+    httpServer->setRequestHandler([streaming = configuration.metrics().streaming](HttpServer::Request& request) {
         if (request.endpoint() == "/metrics") {
             if (metricsPresenter) {
-                request.setResponseContent(metricsPresenter->present());
+                const auto& headers = request.requestHeaders();
+                const auto header = [&headers](const std::string& name) -> std::string_view {
+                    const auto it = headers.find(name);
+                    return it != std::end(headers) ? std::string_view{ it->second } : std::string_view{};
+                };
+
+                const auto format = negotiateMetricsFormat(header("accept"));
+                auto encoding = negotiateContentEncoding(header("accept-encoding"));
+
+                request.addResponseHeader("Content-Type", formatter(format).contentType());
+                request.addResponseHeader("Vary", "Accept, Accept-Encoding");
+
+                const auto start = std::chrono::steady_clock::now();
+
+                // Compressed bodies are small and cached, only uncompressed ones are streamed
+                if (streaming && encoding == ContentEncoding::Identity) {
+                    // Streams are rendered while they're sent, so their duration includes sending
+                    request.setResponseContent(
+                        [stream = metricsPresenter->stream(format), start, sent = std::size_t{ 0 }](
+                            char* buffer,
+                            const std::size_t size
+                        ) mutable {
+                            const auto read = stream.read(buffer, size);
+                            sent += read;
+
+                            if (read == 0) {
+                                observeResponse(start, sent);
+                            }
+
+                            return read;
+                        }
+                    );
+                } else {
+                    auto content = metricsPresenter->present(format, encoding);
+
+                    if (content.empty()) {
+                        encoding = ContentEncoding::Identity;
+                        content = metricsPresenter->present(format);
+                    }
+
+                    if (encoding != ContentEncoding::Identity) {
+                        request.addResponseHeader("Content-Encoding", toString(encoding));
+                    }
+
+                    std::size_t size = 0;
+
+                    for (const auto& piece : content) {
+                        size += piece->size();
+                    }
+
+                    observeResponse(start, size);
+                    request.setResponseContent(std::move(content));
+                }
             } else {
                 request.setResponseCode(500);
                 request.setResponseContent("MetricsPresenter is not initialized");
@@ -0,0 +1,66 @@
+#include "MessageRing.h"
+
+#include <algorithm>
+#include <bit>
+
+MessageRing::MessageRing(const std::size_t capacity)
+    : _mask{ std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1 }
+    , _slots{ std::make_unique<Slot[]>(_mask + 1) }
+{
+    for (auto i = 0u; i <= _mask; ++i) {
+        _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool MessageRing::tryPush(
+    const int messageId,
+    const std::string_view topic,
+    const std::span<const uint8_t> payload,
+    const int qos,
+    const bool retain,
+    const std::chrono::steady_clock::time_point received
+) {
+    auto position = _enqueuePosition.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+
+    // Claim a slot, see Dmitry Vyukov's bounded MPMC queue
+    while (true) {
+        slot = &_slots[position & _mask];
+
+        const auto sequence = slot->sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+
+        if (diff == 0) {
+            if (_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full
+            return false;
+        } else {
+            position = _enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Assigning reuses the buffers allocated for previous messages
+    slot->message.messageId = messageId;
+    slot->message.topic.assign(topic);
+    slot->message.payload.assign(std::cbegin(payload), std::cend(payload));
+    slot->message.qos = qos;
+    slot->message.retain = retain;
+    slot->message.received = received;
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    return true;
+}
+
+bool MessageRing::empty() const
+{
+    return _slots[_dequeuePosition & _mask].sequence.load(std::memory_order_acquire) != _dequeuePosition + 1;
+}
+
+std::size_t MessageRing::capacity() const
+{
+    return _mask + 1;
+}
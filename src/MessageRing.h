@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bounded lock-free multi-producer single-consumer queue of MQTT messages.
+// Slots are allocated up front and their buffers are reused, so after the
+// first few messages pushing doesn't allocate.
+class MessageRing final
+{
+public:
+    // The capacity is rounded up to the next power of two
+    explicit MessageRing(std::size_t capacity);
+
+    struct Message
+    {
+        int messageId = 0;
+        std::string topic;
+        std::vector<uint8_t> payload;
+        int qos = 0;
+        bool retain = false;
+        // When Mosquitto handed the message over
+        std::chrono::steady_clock::time_point received;
+    };
+
+    // Can be called from any thread. Returns false if the ring is full.
+    bool tryPush(
+        int messageId,
+        std::string_view topic,
+        std::span<const uint8_t> payload,
+        int qos,
+        bool retain,
+        std::chrono::steady_clock::time_point received
+    );
+
+    // Must only be called from one thread at a time.
+    // Calls `handler` with at most `maxCount` messages and returns their number.
+    template <typename Handler>
+    std::size_t drain(const std::size_t maxCount, Handler&& handler)
+    {
+        std::size_t count = 0;
+
+        while (count < maxCount) {
+            auto& slot = _slots[_dequeuePosition & _mask];
+
+            if (slot.sequence.load(std::memory_order_acquire) != _dequeuePosition + 1) {
+                break;
+            }
+
+            handler(static_cast<const Message&>(slot.message));
+
+            slot.sequence.store(_dequeuePosition + _mask + 1, std::memory_order_release);
+            ++_dequeuePosition;
+            ++count;
+        }
+
+        return count;
+    }
+
+    // Must only be called from the consumer thread
+    bool empty() const;
+    std::size_t capacity() const;
+
+private:
+    static constexpr std::size_t CacheLineSize = 64;
+
+    struct alignas(CacheLineSize) Slot
+    {
+        std::atomic_size_t sequence{ 0 };
+        Message message;
+    };
+
+    const std::size_t _mask;
+    std::unique_ptr<Slot[]> _slots;
+    alignas(CacheLineSize) std::atomic_size_t _enqueuePosition{ 0 };
+    alignas(CacheLineSize) std::size_t _dequeuePosition = 0;
+};
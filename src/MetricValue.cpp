@@ -0,0 +1,111 @@
+#include "MetricValue.h"
+
+#include <array>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+
+namespace
+{
+    // Exactly representable powers of ten
+    constexpr std::array<double, 23> PowersOfTen{
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // Most payloads are short plain decimals like "21.5". When the digits fit into
+    // the 53 bit mantissa, dividing by an exact power of ten is correctly rounded,
+    // so the slower general parser can be skipped.
+    std::optional<double> parseShortDecimal(const std::string_view text)
+    {
+        static constexpr std::size_t MaxDigits = 15;
+
+        auto it = std::begin(text);
+        const auto end = std::end(text);
+
+        const auto negative = it != end && *it == '-';
+
+        if (negative) {
+            ++it;
+        }
+
+        std::uint64_t mantissa = 0;
+        std::size_t digits = 0;
+        std::size_t fractionDigits = 0;
+        auto seenPoint = false;
+
+        for (; it != end; ++it) {
+            const auto c = *it;
+
+            if (c >= '0' && c <= '9') {
+                mantissa = mantissa * 10 + static_cast<unsigned>(c - '0');
+                fractionDigits += seenPoint;
+
+                if (++digits > MaxDigits) {
+                    return std::nullopt;
+                }
+            } else if (c == '.' && !seenPoint) {
+                seenPoint = true;
+            } else {
+                return std::nullopt;
+            }
+        }
+
+        if (digits == 0) {
+            return std::nullopt;
+        }
+
+        const auto value = static_cast<double>(mantissa) / PowersOfTen[fractionDigits];
+
+        return negative ? -value : value;
+    }
+}
+
+std::optional<double> parseMetricValue(std::string_view text)
+{
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) {
+        text.remove_suffix(1);
+    }
+
+    if (const auto value = parseShortDecimal(text)) {
+        return value;
+    }
+
+    // from_chars handles exponents, "NaN" and "Inf" in any case, but not a leading plus sign
+    if (text.size() > 1 && text.front() == '+' && text[1] != '-') {
+        text.remove_prefix(1);
+    }
+
+    auto value = 0.0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+
+    // Values out of range are rejected rather than clamped
+    if (ec != std::errc{} || ptr != text.data() + text.size()) {
+        return std::nullopt;
+    }
+
+    return value;
+}
+
+void appendMetricValue(std::string& content, const double value)
+{
+    if (std::isnan(value)) {
+        content += "NaN";
+        return;
+    }
+
+    if (std::isinf(value)) {
+        content += value > 0 ? "+Inf" : "-Inf";
+        return;
+    }
+
+    // Large enough for the shortest representation of any double
+    char buffer[32];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+    content.append(buffer, result.ptr);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Parses a sample value: decimals, exponents, NaN and +/-Inf, surrounding whitespace is ignored.
+// Returns nullopt if the text isn't a number.
+std::optional<double> parseMetricValue(std::string_view text);
+
+// Appends the shortest text that parses back to the same value, in the exposition format's
+// spelling of the special values: NaN, +Inf and -Inf
+void appendMetricValue(std::string& content, double value);
@@ -1,46 +1,1270 @@
 #include "MetricsAccumulator.h"
+#include "MetricValue.h"
+#include "TaskQueue.h"
 
-MetricsAccumulator::MetricsAccumulator(const LoggerFactory& loggerFactory)
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+    constexpr auto Prefix = "mqtt";
+
+    // Estimated bookkeeping of a series besides its strings: map nodes, slot and shared objects
+    constexpr std::size_t SeriesOverhead = 256;
+    // Same for a topic entry besides its topic and labels
+    constexpr std::size_t TopicOverhead = 192;
+
+    // Microseconds
+    constexpr std::array<std::uint64_t, 13> LatencyBounds{
+        100, 1'000, 5'000, 10'000, 50'000, 100'000, 500'000,
+        1'000'000, 5'000'000, 10'000'000, 30'000'000, 60'000'000, 120'000'000
+    };
+
+    // Statistics have a single writer, so they are updated without read-modify-write operations
+    void increment(std::atomic_uint64_t& counter, const std::uint64_t value = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void decrement(std::atomic_uint64_t& counter, const std::uint64_t value = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) - value, std::memory_order_relaxed);
+    }
+
+    std::uint64_t microseconds(const std::chrono::steady_clock::duration duration)
+    {
+        const auto count = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        return count > 0 ? static_cast<std::uint64_t>(count) : 0;
+    }
+
+    void appendNamePart(std::string& name, const std::string_view part)
+    {
+        std::transform(
+            std::cbegin(part),
+            std::cend(part),
+            std::back_inserter(name),
+            [](const char c) {
+                if (c == '/' || c == '.') {
+                    return '_';
+                }
+
+                return c;
+            }
+        );
+    }
+
+    // "a/b" -> "mqtt_a_b"
+    std::string metricName(const std::string_view topic)
+    {
+        auto name = fmt::format("{}_", Prefix);
+        appendNamePart(name, topic);
+        return name;
+    }
+
+    // "a", "c.d" -> "a_c_d"
+    std::string metricName(std::string name, const std::string_view field)
+    {
+        name += '_';
+        appendNamePart(name, field);
+        return name;
+    }
+
+    // "name,label=value,..." identifies a series
+    std::string seriesKey(const std::string& name, const MetricsAccumulator::Labels& labels)
+    {
+        auto key = name;
+
+        for (const auto& [label, value] : labels) {
+            key += fmt::format(",{}={}", label, value);
+        }
+
+        return key;
+    }
+}
+
+MetricsAccumulator::MetricsAccumulator(
+    const LoggerFactory& loggerFactory,
+    TaskQueue& taskQueue,
+    Configuration config
+)
     : _log{ loggerFactory.create("MetricsAccumulator") }
+    , _taskQueue{ taskQueue }
+    , _config{ std::move(config) }
+    , _snapshot{ std::make_shared<const Snapshot>() }
+    , _ingestLatencies{ LatencyBounds }
+    , _visibilityLatencies{ LatencyBounds }
 {
-    _log.info("Created");
+    std::size_t maxFields = 0;
+
+    // Reserved up front, topic entries point into the vector
+    _rules.reserve(_config.rules.size());
+
+    for (const auto& rule : _config.rules) {
+        // Duplicate fields would map to the same metric
+        auto fields = rule.fields;
+        std::sort(std::begin(fields), std::end(fields));
+        fields.erase(std::unique(std::begin(fields), std::end(fields)), std::end(fields));
+
+        if (!_ruleTrie.insert(rule.topic, _rules.size())) {
+            _log.warn("Ignoring duplicate rule: topic={}", rule.topic);
+            continue;
+        }
+
+        maxFields = std::max(maxFields, fields.size());
+
+        if (!rule.unit.empty() && !rule.metric.ends_with("_" + rule.unit)) {
+            _log.warn("Metric name doesn't end with its unit, ignored by OpenMetrics: rule={}, unit={}", rule.topic, rule.unit);
+        }
+
+        auto aggregation = rule.aggregation;
+        auto& buckets = aggregation.buckets;
+        auto& quantiles = aggregation.quantiles;
+
+        // The +Inf bucket is implicit
+        std::erase_if(buckets, [](const double bound) { return !std::isfinite(bound); });
+        std::sort(std::begin(buckets), std::end(buckets));
+        buckets.erase(std::unique(std::begin(buckets), std::end(buckets)), std::end(buckets));
+
+        std::erase_if(quantiles, [](const double quantile) { return !(quantile >= 0.0 && quantile <= 1.0); });
+        std::sort(std::begin(quantiles), std::end(quantiles));
+        quantiles.erase(std::unique(std::begin(quantiles), std::end(quantiles)), std::end(quantiles));
+
+        const auto windowed = aggregation.window > std::chrono::seconds::zero();
+        const auto derivedSeries = (aggregation.count ? 1 : 0)
+            + (windowed ? 3 : 0)
+            + (buckets.empty() ? 0 : 1)
+            + (quantiles.empty() ? 0 : 1);
+        const auto aggregationMemory = derivedSeries > 0
+            ? sizeof(Aggregator)
+                + derivedSeries * SeriesOverhead
+                + (buckets.size() + 1) * sizeof(std::uint64_t)
+                + (quantiles.empty() ? 0 : SummaryValues * sizeof(Aggregator::recentValues[0]))
+            : 0;
+
+        _rules.push_back(
+            CompiledRule{
+                .topic = rule.topic,
+                .metric = rule.metric,
+                .help = rule.help,
+                .unit = rule.unit,
+                .fields = fields,
+                .extractor = JsonFieldExtractor{ fields },
+                .expiryList = expiryList(rule.ttl.value_or(_config.ttl)),
+                .coalesceInterval = rule.coalesceInterval.value_or(_config.coalesceInterval),
+                .aggregation = std::move(aggregation),
+                .aggregated = derivedSeries > 0,
+                .aggregationMemory = aggregationMemory
+            }
+        );
+    }
+
+    _fieldValues.resize(maxFields);
+    _defaultExpiryList = expiryList(_config.ttl);
+
+    _admissionTokens = std::max(_config.seriesAdmissionRate, 1.0);
+    _admissionTime = std::chrono::steady_clock::now();
+
+    _log.info(
+        "Created: publishInterval={}ms, rules={}, ttl={}s, coalesceInterval={}ms, maxSeries={}, maxMemory={}, overflowPolicy={}, seriesAdmissionRate={}",
+        _config.publishInterval.count(),
+        _rules.size(),
+        _config.ttl.count(),
+        _config.coalesceInterval.count(),
+        _config.maxSeries,
+        _config.maxMemory,
+        _config.overflowPolicy == Configuration::OverflowPolicy::Evict ? "evict" : "reject",
+        _config.seriesAdmissionRate
+    );
 }
 
-void MetricsAccumulator::add(const std::string& key, std::string value)
+void MetricsAccumulator::add(
+    const std::string_view topic,
+    const std::string_view payload,
+    const std::chrono::steady_clock::time_point received
+) {
+    const auto timestamp = std::chrono::system_clock::now();
+
+    auto& entry = resolve(topic);
+
+    if (entry.coalesceInterval > std::chrono::milliseconds::zero()) {
+        const auto now = std::chrono::steady_clock::now();
+
+        if (entry.pending || now < entry.processed + entry.coalesceInterval) {
+            if (entry.pending) {
+                increment(_statistics.coalescedPayloads);
+            } else {
+                entry.pending = true;
+
+                const auto due = entry.processed + entry.coalesceInterval;
+                _pendingTopics.push_back(PendingTopic{ .due = due, .entry = &entry });
+                std::push_heap(std::begin(_pendingTopics), std::end(_pendingTopics));
+                scheduleCoalesced(due);
+            }
+
+            // Reuses the capacity of the previous payload
+            entry.pendingPayload.assign(payload);
+            entry.pendingTimestamp = timestamp;
+            entry.pendingReceived = received;
+
+            return;
+        }
+
+        entry.processed = now;
+    }
+
+    process(entry, payload, timestamp, received);
+}
+
+void MetricsAccumulator::process(
+    TopicEntry& entry,
+    const std::string_view payload,
+    const std::chrono::system_clock::time_point timestamp,
+    const std::chrono::steady_clock::time_point received
+) {
+    const std::string_view topic{ *entry.topic };
+    auto updated = false;
+
+    increment(_statistics.processedPayloads);
+    _ingestLatencies.observe(microseconds(std::chrono::steady_clock::now() - received));
+
+    if (!entry.rule || entry.rule->fields.empty()) {
+        if (const auto number = parseMetricValue(payload)) {
+            updated = update(entry, 0, *number, timestamp);
+        } else {
+            increment(_statistics.invalidPayloads);
+            _log.debug("Add: ignoring non-numeric value, topic={}, payload={}", topic, payload);
+        }
+    } else {
+        const auto& rule = *entry.rule;
+
+        std::fill(std::begin(_fieldValues), std::end(_fieldValues), std::nullopt);
+
+        if (rule.extractor.extract(payload, _fieldValues) == 0) {
+            increment(_statistics.invalidPayloads);
+            _log.debug("Add: no fields found, topic={}, rule={}", topic, rule.topic);
+        }
+
+        for (auto i = 0u; i < rule.fields.size(); ++i) {
+            if (_fieldValues[i]) {
+                updated = update(entry, i, *_fieldValues[i], timestamp) || updated;
+            }
+        }
+    }
+
+    // Topics without series aren't kept, so rejected or garbage topics don't accumulate.
+    // The payload may be owned by the entry, it's not used after this.
+    if (!hasSeries(entry)) {
+        eraseTopic(topic);
+    }
+
+    if (_config.overflowPolicy == Configuration::OverflowPolicy::Evict) {
+        evict();
+    }
+
+    if (updated) {
+        sampleReceipt(received);
+        schedulePublish();
+    }
+}
+
+void MetricsAccumulator::sampleReceipt(const std::chrono::steady_clock::time_point received)
 {
-    if (value.find_first_not_of("0123456789.") != std::string::npos) {
-        _log.debug("Add: ignoring non-numeric value, key={}, value={}", key, value);
+    if (++_skippedReceipts < _receiptWeight) {
         return;
     }
 
-    const auto timestamp = std::chrono::system_clock::now();
+    _skippedReceipts = 0;
 
-    const auto keyTransformer = [](const char c) {
-        if (c == '/') {
-            return '_';
+    if (_receipts.size() == MaxReceiptSamples) {
+        for (auto i = 0u; i < MaxReceiptSamples / 2; ++i) {
+            _receipts[i] = _receipts[i * 2];
         }
 
-        return c;
+        _receipts.resize(MaxReceiptSamples / 2);
+        _receiptWeight *= 2;
+    }
+
+    _receipts.push_back(received);
+}
+
+void MetricsAccumulator::stop()
+{
+    _stopped = true;
+
+    if (_expiryTimer) {
+        _taskQueue.cancel(_expiryTimer);
+        _expiryTimer = 0;
+    }
+
+    if (_coalesceTimer) {
+        _taskQueue.cancel(_coalesceTimer);
+        _coalesceTimer = 0;
+    }
+}
+
+MetricsAccumulator::Statistics MetricsAccumulator::statistics() const
+{
+    const auto load = [](const std::atomic_uint64_t& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+
+    return Statistics{
+        .series = load(_statistics.series),
+        .memory = load(_statistics.memory),
+        .rejectedSeries = load(_statistics.rejectedSeries),
+        .evictedSeries = load(_statistics.evictedSeries),
+        .expiredSeries = load(_statistics.expiredSeries),
+        .coalescedPayloads = load(_statistics.coalescedPayloads),
+        .processedPayloads = load(_statistics.processedPayloads),
+        .invalidPayloads = load(_statistics.invalidPayloads)
     };
+}
+
+MetricsAccumulator::TopicEntry& MetricsAccumulator::resolve(const std::string_view topic)
+{
+    if (const auto it = _topics.find(topic); it != std::end(_topics)) {
+        return it->second;
+    }
 
-    std::string metricKey;
-    std::transform(
-        std::cbegin(key),
-        std::cend(key),
-        std::back_inserter(metricKey),
-        keyTransformer
+    TopicEntry entry;
+
+    if (const auto* index = _ruleTrie.find(topic, &entry.labels)) {
+        entry.rule = &_rules[*index];
+    }
+
+    entry.expiryList = entry.rule ? entry.rule->expiryList : _defaultExpiryList;
+    entry.coalesceInterval = entry.rule ? entry.rule->coalesceInterval : _config.coalesceInterval;
+    entry.metrics.resize(entry.rule && !entry.rule->fields.empty() ? entry.rule->fields.size() : 1);
+
+    _log.debug(
+        "Resolve: topic={}, rule={}, labels={}",
+        topic,
+        entry.rule ? entry.rule->topic : "",
+        entry.labels.size()
     );
 
+    const auto it = _topics.emplace(topic, std::move(entry)).first;
+    it->second.topic = &it->first;
+
+    return it->second;
+}
+
+void MetricsAccumulator::scheduleCoalesced(const std::chrono::steady_clock::time_point time)
+{
+    if (_stopped) {
+        return;
+    }
+
+    if (_coalesceTimer) {
+        if (time >= _coalesceTime) {
+            return;
+        }
+
+        _taskQueue.cancel(_coalesceTimer);
+    }
+
+    const auto after = std::chrono::ceil<std::chrono::milliseconds>(time - std::chrono::steady_clock::now());
+
+    _coalesceTime = time;
+    _coalesceTimer = _taskQueue.pushDelayed("MetricsAccumulatorCoalesce", [this](auto&) {
+        _coalesceTimer = 0;
+        processCoalesced();
+    }, std::max(after, std::chrono::milliseconds::zero()));
+}
+
+void MetricsAccumulator::processCoalesced()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    while (!_pendingTopics.empty() && _pendingTopics.front().due <= now) {
+        auto& entry = *_pendingTopics.front().entry;
+        std::pop_heap(std::begin(_pendingTopics), std::end(_pendingTopics));
+        _pendingTopics.pop_back();
+
+        entry.pending = false;
+        entry.processed = now;
+        process(entry, entry.pendingPayload, entry.pendingTimestamp, entry.pendingReceived);
+    }
+
+    if (!_pendingTopics.empty()) {
+        scheduleCoalesced(_pendingTopics.front().due);
+    }
+}
+
+bool MetricsAccumulator::hasSeries(const TopicEntry& entry) const
+{
+    return std::any_of(std::cbegin(entry.metrics), std::cend(entry.metrics), [this](const MetricRef& ref) {
+        return ref.id != NoMetric && _slots[ref.id].generation == ref.generation;
+    });
+}
+
+bool MetricsAccumulator::update(
+    TopicEntry& entry,
+    const std::size_t field,
+    const double value,
+    const std::chrono::system_clock::time_point timestamp
+) {
+    const auto id = resolveMetric(entry, field);
+
+    if (id == NoMetric) {
+        increment(_statistics.rejectedSeries);
+        return false;
+    }
+
+    set(id, value, timestamp);
+
+    if (const auto aggregator = _slots[id].aggregator; aggregator != NoAggregator) {
+        aggregate(aggregator, value, timestamp);
+    }
+
+    return true;
+}
+
+MetricsAccumulator::MetricId MetricsAccumulator::resolveMetric(TopicEntry& entry, const std::size_t field)
+{
+    auto& ref = entry.metrics[field];
+
+    // The series may have expired since the last update
+    if (ref.id != NoMetric && _slots[ref.id].generation == ref.generation) {
+        return ref.id;
+    }
+
+    ref.id = intern(*entry.topic, entry, field);
+
+    if (ref.id != NoMetric) {
+        ref.generation = _slots[ref.id].generation;
+    }
+
+    return ref.id;
+}
+
+MetricsAccumulator::MetricId MetricsAccumulator::intern(
+    const std::string_view topic,
+    TopicEntry& entry,
+    const std::size_t field
+) {
+    const auto* rule = entry.rule;
+
+    // Without a metric name each topic is a family of its own
+    const auto grouped = rule && !rule->metric.empty();
+    auto name = grouped ? rule->metric : metricName(topic);
+
+    if (rule && !rule->fields.empty()) {
+        name = metricName(std::move(name), rule->fields[field]);
+    }
+
+    auto key = seriesKey(name, entry.labels);
+
+    // Charged once per entry, the other fields of the topic may have series already
+    std::size_t entryMemory = 0;
+
+    if (entry.memory == 0) {
+        entryMemory = TopicOverhead + topic.size() + entry.metrics.size() * sizeof(MetricRef);
+
+        for (const auto& [label, value] : entry.labels) {
+            entryMemory += label.size() + value.size();
+        }
+    }
+
+    // Different topics can map to the same series, e.g. "a/b" and "a_b"
+    if (const auto it = _metricIdsBySeries.find(key); it != std::end(_metricIdsBySeries)) {
+        const auto id = it->second;
+
+        // Derived series are owned by their aggregator, e.g. "sensors/a_min" can't update the one of "sensors/a"
+        if (_slots[id].topics.empty()) {
+            _log.debug("Intern: series={} is derived, topic={}", key, topic);
+            return NoMetric;
+        }
+
+        // Every topic costs memory, e.g. "sensors/<uuid>" of a rule without captures maps to a single series
+        if (
+            _config.overflowPolicy == Configuration::OverflowPolicy::Reject
+            && !withinLimits(
+                _statistics.series.load(std::memory_order_relaxed),
+                _statistics.memory.load(std::memory_order_relaxed) + entryMemory
+            )
+        ) {
+            _log.debug("Intern: rejected topic={}, series={}", topic, key);
+            return NoMetric;
+        }
+
+        attach(id, entry, entryMemory);
+
+        return id;
+    }
+
+    // Rough, but proportional to what an unbounded number of topics would cost
+    const auto memory = SeriesOverhead + 2 * key.size() + (rule ? rule->aggregationMemory : 0);
+
+    if (!admit(memory + entryMemory)) {
+        _log.debug("Intern: rejected series={}", key);
+        return NoMetric;
+    }
+
+    Family family{
+        .name = name,
+        .help = rule ? rule->help : std::string{},
+        .unit = rule ? rule->unit : std::string{}
+    };
+
+    const auto id = intern(std::move(key), std::move(family), grouped, entry.labels);
+    auto& slot = _slots[id];
+    slot.expiryList = entry.expiryList;
+    slot.memory = static_cast<std::uint32_t>(memory);
+
+    increment(_statistics.series);
+    increment(_statistics.memory, memory);
+    attach(id, entry, entryMemory);
+
+    if (rule && rule->aggregated) {
+        createAggregator(id, *rule, name, grouped, entry.labels);
+    }
+
+    return id;
+}
+
+void MetricsAccumulator::attach(const MetricId id, TopicEntry& entry, const std::size_t entryMemory)
+{
+    _slots[id].topics.push_back(entry.topic);
+
+    if (entryMemory > 0) {
+        entry.memory = static_cast<std::uint32_t>(entryMemory);
+        increment(_statistics.memory, entryMemory);
+    }
+}
+
+void MetricsAccumulator::eraseTopic(const std::string_view topic)
+{
+    const auto it = _topics.find(topic);
+    decrement(_statistics.memory, it->second.memory);
+    _topics.erase(it);
+}
+
+MetricsAccumulator::MetricId MetricsAccumulator::intern(
+    std::string key,
+    Family family,
+    const bool grouped,
+    const Labels& labels
+) {
+    if (const auto it = _metricIdsBySeries.find(key); it != std::end(_metricIdsBySeries)) {
+        _log.debug("Intern: series={}, id={} (existing)", key, it->second);
+        return it->second;
+    }
+
+    // The properties of the first series of a family apply to all of them
+    auto familyIt = _families.find(family.name);
+
+    if (familyIt == std::end(_families)) {
+        auto name = family.name;
+
+        familyIt = _families.emplace(
+            std::move(name),
+            FamilyEntry{
+                .family = std::make_shared<const Family>(std::move(family)),
+                .grouped = grouped
+            }
+        ).first;
+    }
+
+    auto& familyEntry = familyIt->second;
+    const auto id = allocate(familyEntry);
+    ++familyEntry.seriesCount;
+
+    _log.debug("Intern: series={}, id={}", key, id);
+
+    mutableMetric(id).series = std::make_shared<const Series>(
+        Series{
+            .family = familyEntry.family,
+            .labels = labels
+        }
+    );
+
+    auto& slot = _slots[id];
+    slot.family = &familyEntry;
+    slot.seriesKey = &_metricIdsBySeries.emplace(std::move(key), id).first->first;
+
+    return id;
+}
+
+bool MetricsAccumulator::admit(const std::size_t memory)
+{
+    const auto rate = _config.seriesAdmissionRate;
+
+    if (rate > 0.0) {
+        const auto now = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> elapsed = now - _admissionTime;
+
+        _admissionTime = now;
+        _admissionTokens = std::min(_admissionTokens + elapsed.count() * rate, std::max(rate, 1.0));
+
+        if (_admissionTokens < 1.0) {
+            return false;
+        }
+    }
+
+    // With eviction the limits are restored after the update
+    if (
+        _config.overflowPolicy == Configuration::OverflowPolicy::Reject
+        && !withinLimits(
+            _statistics.series.load(std::memory_order_relaxed) + 1,
+            _statistics.memory.load(std::memory_order_relaxed) + memory
+        )
+    ) {
+        return false;
+    }
+
+    if (rate > 0.0) {
+        _admissionTokens -= 1.0;
+    }
+
+    return true;
+}
+
+bool MetricsAccumulator::withinLimits(const std::size_t series, const std::size_t memory) const
+{
+    return (_config.maxSeries == 0 || series <= _config.maxSeries)
+        && (_config.maxMemory == 0 || memory <= _config.maxMemory);
+}
+
+void MetricsAccumulator::evict()
+{
+    while (!withinLimits(
+        _statistics.series.load(std::memory_order_relaxed),
+        _statistics.memory.load(std::memory_order_relaxed)
+    )) {
+        // The oldest head of the lists is the least recently updated series
+        auto oldest = NoMetric;
+
+        for (const auto& list : _expiryLists) {
+            if (list.head != NoMetric && (oldest == NoMetric || metric(list.head).timestamp < metric(oldest).timestamp)) {
+                oldest = list.head;
+            }
+        }
+
+        if (oldest == NoMetric) {
+            break;
+        }
+
+        remove(oldest);
+        increment(_statistics.evictedSeries);
+    }
+}
+
+MetricsAccumulator::MetricId MetricsAccumulator::allocate(FamilyEntry& familyEntry)
+{
+    auto& freeIds = familyEntry.grouped ? familyEntry.freeIds : _sharedFreeIds;
+
+    if (!freeIds.empty()) {
+        const auto id = freeIds.back();
+        freeIds.pop_back();
+        return id;
+    }
+
+    auto& chunk = familyEntry.grouped ? familyEntry.lastChunk : _sharedChunk;
+
+    if (chunk == NoChunk || _chunkSizes[chunk] == ChunkSize) {
+        // A family's new chunk is published right after its previous one
+        chunk = addChunk(chunk, familyEntry.grouped ? &familyEntry : nullptr);
+    }
+
+    return chunk * ChunkSize + _chunkSizes[chunk]++;
+}
+
+std::uint32_t MetricsAccumulator::addChunk(const std::uint32_t after, const FamilyEntry* familyEntry)
+{
+    const auto index = static_cast<std::uint32_t>(_chunks.size());
+
+    auto chunk = std::make_shared<Chunk>();
+
+    if (familyEntry) {
+        chunk->family = familyEntry->family;
+        chunk->familyStart = familyEntry->lastChunk == NoChunk;
+    }
+
+    _chunks.push_back(std::move(chunk));
+    _chunkSizes.push_back(0);
+    _slots.resize(_chunks.size() * ChunkSize);
+
+    // Chunks of different families are appended
+    const auto position = familyEntry
+        ? std::find(std::begin(_chunkOrder), std::end(_chunkOrder), after)
+        : std::end(_chunkOrder);
+    _chunkOrder.insert(position != std::end(_chunkOrder) ? position + 1 : std::end(_chunkOrder), index);
+
+    return index;
+}
+
+void MetricsAccumulator::set(
+    const MetricId id,
+    const double value,
+    const std::chrono::system_clock::time_point timestamp
+) {
     _log.debug(
-        "Add: key={}, metricKey={}, value={}, timestamp={:d}",
-        key,
-        metricKey,
+        "Set: id={}, value={}, timestamp={:d}",
+        id,
         value,
         std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()).count()
     );
 
-    _metrics[metricKey] = Metric{
-        .value = std::move(value),
-        .timestamp = std::move(timestamp)
+    auto& metric = mutableMetric(id);
+    metric.value = value;
+    metric.timestamp = timestamp;
+
+    if (_slots[id].expiryList != NoList) {
+        // Move to the tail, it's the most recently updated series now
+        unlink(id);
+        link(id);
+
+        if (const auto ttl = _expiryLists[_slots[id].expiryList].ttl; ttl > std::chrono::seconds::zero()) {
+            scheduleExpiry(timestamp + ttl);
+        }
+    }
+}
+
+void MetricsAccumulator::remove(const MetricId id)
+{
+    auto& slot = _slots[id];
+
+    _log.debug("Remove: series={}, id={}", *slot.seriesKey, id);
+
+    unlink(id);
+    mutableMetric(id) = Metric{};
+    ++slot.generation;
+
+    if (slot.aggregator != NoAggregator) {
+        removeAggregator(slot.aggregator);
+        slot.aggregator = NoAggregator;
+    }
+
+    // Derived series have no topic and aren't accounted separately
+    if (!slot.topics.empty()) {
+        decrement(_statistics.series);
+        decrement(_statistics.memory, slot.memory);
+
+        // Topic entries go away with their last series, the topics may never be seen again.
+        // Entries with a deferred payload are referenced by _pendingTopics.
+        for (const auto* topic : slot.topics) {
+            if (
+                const auto it = _topics.find(*topic);
+                it != std::end(_topics) && !it->second.pending && !hasSeries(it->second)
+            ) {
+                eraseTopic(*topic);
+            }
+        }
+    }
+
+    // Copied, the erased element owns the key
+    _metricIdsBySeries.erase(std::string{ *slot.seriesKey });
+
+    auto& familyEntry = *slot.family;
+    --familyEntry.seriesCount;
+
+    if (familyEntry.grouped) {
+        familyEntry.freeIds.push_back(id);
+    } else {
+        _sharedFreeIds.push_back(id);
+
+        if (familyEntry.seriesCount == 0) {
+            // Copied, the erased element owns the name
+            _families.erase(std::string{ familyEntry.family->name });
+        }
+    }
+
+    slot.topics.clear();
+    slot.seriesKey = nullptr;
+    slot.family = nullptr;
+    slot.memory = 0;
+    slot.expiryList = NoList;
+}
+
+void MetricsAccumulator::createAggregator(
+    const MetricId source,
+    const CompiledRule& rule,
+    const std::string& name,
+    const bool grouped,
+    const Labels& labels
+) {
+    std::uint32_t index;
+
+    if (!_freeAggregators.empty()) {
+        index = _freeAggregators.back();
+        _freeAggregators.pop_back();
+    } else {
+        index = static_cast<std::uint32_t>(_aggregators.size());
+        _aggregators.emplace_back();
+    }
+
+    const auto derive = [this, &name, grouped, &labels](const std::string_view suffix, const MetricType type) {
+        Family family{
+            .name = name,
+            .type = type
+        };
+
+        family.name += suffix;
+        auto key = seriesKey(family.name, labels);
+
+        // Never shared with another series, removing the aggregator would remove that one too
+        if (_metricIdsBySeries.contains(key)) {
+            _log.warn("Aggregate: skipping derived series={}, the name is taken", key);
+            return NoMetric;
+        }
+
+        return intern(std::move(key), std::move(family), grouped, labels);
     };
-}
\ No newline at end of file
+
+    const auto& aggregation = rule.aggregation;
+    auto& aggregator = _aggregators[index];
+
+    aggregator = Aggregator{
+        .source = source,
+        .rule = &rule
+    };
+
+    if (aggregation.count) {
+        aggregator.count = derive("_messages_total", MetricType::Counter);
+    }
+
+    if (aggregation.window > std::chrono::seconds::zero()) {
+        aggregator.min = derive("_min", MetricType::Gauge);
+        aggregator.max = derive("_max", MetricType::Gauge);
+        aggregator.avg = derive("_avg", MetricType::Gauge);
+    }
+
+    if (!aggregation.buckets.empty()) {
+        aggregator.histogram = derive("_histogram", MetricType::Histogram);
+        aggregator.bucketCounts.resize(aggregation.buckets.size() + 1);
+    }
+
+    if (!aggregation.quantiles.empty()) {
+        aggregator.summary = derive("_summary", MetricType::Summary);
+        aggregator.recentValues.reserve(SummaryValues);
+    }
+
+    _slots[source].aggregator = index;
+}
+
+void MetricsAccumulator::removeAggregator(const std::uint32_t index)
+{
+    auto& aggregator = _aggregators[index];
+
+    for (const auto id : { aggregator.count, aggregator.min, aggregator.max, aggregator.avg, aggregator.histogram, aggregator.summary }) {
+        if (id != NoMetric) {
+            remove(id);
+        }
+    }
+
+    // Also clears the dirty flag, a queued index is skipped when publishing
+    aggregator = Aggregator{};
+    _freeAggregators.push_back(index);
+}
+
+void MetricsAccumulator::aggregate(
+    const std::uint32_t index,
+    const double value,
+    const std::chrono::system_clock::time_point timestamp
+) {
+    auto& aggregator = _aggregators[index];
+    const auto& aggregation = aggregator.rule->aggregation;
+
+    aggregator.timestamp = timestamp;
+    ++aggregator.values;
+
+    // Derived values are computed when publishing, at most once per snapshot
+    if (!aggregator.dirty) {
+        aggregator.dirty = true;
+        _dirtyAggregators.push_back(index);
+    }
+
+    if (std::isnan(value)) {
+        return;
+    }
+
+    ++aggregator.observations;
+    aggregator.sum += value;
+
+    if (aggregation.window > std::chrono::seconds::zero()) {
+        const auto sliceDuration = std::chrono::duration_cast<std::chrono::milliseconds>(aggregation.window) / static_cast<std::int64_t>(WindowSlices);
+        const auto sliceIndex = std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()) / sliceDuration;
+        auto& slice = aggregator.window[static_cast<std::size_t>(sliceIndex) % WindowSlices];
+
+        // The slice is reused once the window has moved past it
+        if (slice.index != sliceIndex) {
+            slice = WindowSlice{
+                .index = sliceIndex,
+                .min = value,
+                .max = value
+            };
+        }
+
+        slice.min = std::min(slice.min, value);
+        slice.max = std::max(slice.max, value);
+        slice.sum += value;
+        ++slice.count;
+    }
+
+    if (aggregator.histogram != NoMetric) {
+        // Upper bounds are inclusive
+        const auto& buckets = aggregation.buckets;
+        ++aggregator.bucketCounts[std::lower_bound(std::cbegin(buckets), std::cend(buckets), value) - std::cbegin(buckets)];
+    }
+
+    if (aggregator.summary != NoMetric) {
+        auto& recentValues = aggregator.recentValues;
+
+        if (recentValues.size() < SummaryValues) {
+            recentValues.emplace_back(timestamp, value);
+        } else {
+            recentValues[aggregator.nextValue] = { timestamp, value };
+        }
+
+        aggregator.nextValue = (aggregator.nextValue + 1) % SummaryValues;
+    }
+}
+
+void MetricsAccumulator::publishAggregator(Aggregator& aggregator)
+{
+    const auto& aggregation = aggregator.rule->aggregation;
+    const auto timestamp = aggregator.timestamp;
+
+    if (aggregator.count != NoMetric) {
+        set(aggregator.count, static_cast<double>(aggregator.values), timestamp);
+    }
+
+    if (aggregation.window > std::chrono::seconds::zero()) {
+        const auto sliceDuration = std::chrono::duration_cast<std::chrono::milliseconds>(aggregation.window) / static_cast<std::int64_t>(WindowSlices);
+        const auto lastIndex = std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()) / sliceDuration;
+
+        auto min = std::numeric_limits<double>::infinity();
+        auto max = -std::numeric_limits<double>::infinity();
+        auto sum = 0.0;
+        std::uint64_t count = 0;
+
+        // The window ends at the last value
+        for (const auto& slice : aggregator.window) {
+            if (slice.count > 0 && slice.index > lastIndex - static_cast<std::int64_t>(WindowSlices)) {
+                min = std::min(min, slice.min);
+                max = std::max(max, slice.max);
+                sum += slice.sum;
+                count += slice.count;
+            }
+        }
+
+        // Each may have been skipped when creating the aggregator
+        if (count > 0) {
+            if (aggregator.min != NoMetric) {
+                set(aggregator.min, min, timestamp);
+            }
+
+            if (aggregator.max != NoMetric) {
+                set(aggregator.max, max, timestamp);
+            }
+
+            if (aggregator.avg != NoMetric) {
+                set(aggregator.avg, sum / static_cast<double>(count), timestamp);
+            }
+        }
+    }
+
+    if (aggregator.histogram != NoMetric) {
+        auto distribution = std::make_shared<Distribution>();
+        distribution->sum = aggregator.sum;
+        distribution->points.reserve(aggregation.buckets.size());
+
+        std::uint64_t cumulativeCount = 0;
+
+        for (auto i = 0u; i < aggregation.buckets.size(); ++i) {
+            cumulativeCount += aggregator.bucketCounts[i];
+            distribution->points.emplace_back(aggregation.buckets[i], static_cast<double>(cumulativeCount));
+        }
+
+        distribution->count = cumulativeCount + aggregator.bucketCounts.back();
+
+        auto& metric = mutableMetric(aggregator.histogram);
+        metric.timestamp = timestamp;
+        metric.distribution = std::move(distribution);
+    }
+
+    if (aggregator.summary != NoMetric) {
+        std::vector<double> values;
+        values.reserve(aggregator.recentValues.size());
+
+        for (const auto& [time, value] : aggregator.recentValues) {
+            if (aggregation.window == std::chrono::seconds::zero() || time > timestamp - aggregation.window) {
+                values.push_back(value);
+            }
+        }
+
+        std::sort(std::begin(values), std::end(values));
+
+        auto distribution = std::make_shared<Distribution>();
+        distribution->count = aggregator.observations;
+        distribution->sum = aggregator.sum;
+        distribution->points.reserve(aggregation.quantiles.size());
+
+        for (const auto quantile : aggregation.quantiles) {
+            // Nearest rank, NaN without recent values
+            const auto value = values.empty()
+                ? std::numeric_limits<double>::quiet_NaN()
+                : values[static_cast<std::size_t>(std::lround(quantile * static_cast<double>(values.size() - 1)))];
+
+            distribution->points.emplace_back(quantile, value);
+        }
+
+        auto& metric = mutableMetric(aggregator.summary);
+        metric.timestamp = timestamp;
+        metric.distribution = std::move(distribution);
+    }
+}
+
+std::uint32_t MetricsAccumulator::expiryList(const std::chrono::seconds ttl)
+{
+    for (auto i = 0u; i < _expiryLists.size(); ++i) {
+        if (_expiryLists[i].ttl == ttl) {
+            return i;
+        }
+    }
+
+    _expiryLists.push_back(ExpiryList{ .ttl = ttl });
+
+    return static_cast<std::uint32_t>(_expiryLists.size() - 1);
+}
+
+void MetricsAccumulator::link(const MetricId id)
+{
+    auto& slot = _slots[id];
+    auto& list = _expiryLists[slot.expiryList];
+
+    slot.previous = list.tail;
+    slot.next = NoMetric;
+
+    if (list.tail != NoMetric) {
+        _slots[list.tail].next = id;
+    } else {
+        list.head = id;
+    }
+
+    list.tail = id;
+}
+
+void MetricsAccumulator::unlink(const MetricId id)
+{
+    auto& slot = _slots[id];
+
+    if (slot.expiryList == NoList) {
+        return;
+    }
+
+    auto& list = _expiryLists[slot.expiryList];
+
+    // Not linked yet
+    if (list.head != id && slot.previous == NoMetric) {
+        return;
+    }
+
+    if (slot.previous != NoMetric) {
+        _slots[slot.previous].next = slot.next;
+    } else {
+        list.head = slot.next;
+    }
+
+    if (slot.next != NoMetric) {
+        _slots[slot.next].previous = slot.previous;
+    } else {
+        list.tail = slot.previous;
+    }
+
+    slot.previous = NoMetric;
+    slot.next = NoMetric;
+}
+
+void MetricsAccumulator::scheduleExpiry(const std::chrono::system_clock::time_point time)
+{
+    // Pending timers would keep the TaskQueue running
+    if (_stopped) {
+        return;
+    }
+
+    if (_expiryTimer) {
+        if (time >= _expiryTime) {
+            return;
+        }
+
+        _taskQueue.cancel(_expiryTimer);
+    }
+
+    const auto after = std::chrono::ceil<std::chrono::milliseconds>(time - std::chrono::system_clock::now());
+
+    _expiryTime = time;
+    _expiryTimer = _taskQueue.pushDelayed("MetricsAccumulatorExpire", [this](auto&) {
+        _expiryTimer = 0;
+        expire();
+    }, std::max(after, std::chrono::milliseconds::zero()));
+}
+
+void MetricsAccumulator::expire()
+{
+    const auto now = std::chrono::system_clock::now();
+    std::size_t removed = 0;
+
+    for (const auto& list : _expiryLists) {
+        if (list.ttl == std::chrono::seconds::zero()) {
+            continue;
+        }
+
+        while (list.head != NoMetric && metric(list.head).timestamp + list.ttl <= now) {
+            remove(list.head);
+            ++removed;
+            increment(_statistics.expiredSeries);
+        }
+
+        if (list.head != NoMetric) {
+            scheduleExpiry(metric(list.head).timestamp + list.ttl);
+        }
+    }
+
+    if (removed > 0) {
+        _log.info("Expired: series={}", removed);
+        schedulePublish();
+    }
+}
+
+const MetricsAccumulator::Metric& MetricsAccumulator::metric(const MetricId id) const
+{
+    return _chunks[id / ChunkSize]->metrics[id % ChunkSize];
+}
+
+MetricsAccumulator::Metric& MetricsAccumulator::mutableMetric(const MetricId id)
+{
+    auto& chunk = _chunks[id / ChunkSize];
+
+    if (chunk.use_count() > 1) {
+        // Still referenced by a snapshot
+        chunk = std::make_shared<Chunk>(*chunk);
+    } else {
+        // Synchronize with the last reader releasing its reference
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    return chunk->metrics[id % ChunkSize];
+}
+
+void MetricsAccumulator::schedulePublish()
+{
+    if (_publishScheduled) {
+        return;
+    }
+
+    _publishScheduled = true;
+
+    // Queued behind the rest of the current batch, so one snapshot covers all of it
+    if (_config.publishInterval == std::chrono::milliseconds::zero()) {
+        _taskQueue.push("MetricsAccumulatorPublish", [this](auto&) {
+            publish();
+        });
+    } else {
+        _taskQueue.pushDelayed("MetricsAccumulatorPublish", [this](auto&) {
+            publish();
+        }, _config.publishInterval);
+    }
+}
+
+void MetricsAccumulator::publish()
+{
+    _publishScheduled = false;
+
+    for (const auto index : _dirtyAggregators) {
+        if (auto& aggregator = _aggregators[index]; aggregator.dirty) {
+            aggregator.dirty = false;
+            publishAggregator(aggregator);
+        }
+    }
+
+    _dirtyAggregators.clear();
+
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->generation = ++_generation;
+    snapshot->chunks.reserve(_chunkOrder.size());
+
+    for (const auto index : _chunkOrder) {
+        snapshot->chunks.push_back(_chunks[index]);
+    }
+
+    // Receipts of generations already scraped aren't needed anymore
+    const auto visibleGeneration = _visibleGeneration.load(std::memory_order_relaxed);
+
+    std::erase_if(_pendingReceipts, [visibleGeneration](const auto& receipts) {
+        return receipts->generation <= visibleGeneration;
+    });
+
+    if (!_receipts.empty()) {
+        _pendingReceipts.push_back(
+            std::make_shared<const Receipts>(
+                Receipts{
+                    .generation = snapshot->generation,
+                    .weight = _receiptWeight,
+                    .received = std::move(_receipts)
+                }
+            )
+        );
+
+        _receipts.clear();
+        _receiptWeight = 1;
+        _skippedReceipts = 0;
+    }
+
+    if (_pendingReceipts.size() > MaxPendingReceipts) {
+        _pendingReceipts.erase(
+            std::begin(_pendingReceipts),
+            std::end(_pendingReceipts) - MaxPendingReceipts
+        );
+    }
+
+    snapshot->receipts = _pendingReceipts;
+
+    _log.debug("Publish: generation={}, chunks={}", snapshot->generation, snapshot->chunks.size());
+
+    std::lock_guard lock{ _snapshotMutex };
+    _snapshot = std::move(snapshot);
+}
+
+std::shared_ptr<const MetricsAccumulator::Snapshot> MetricsAccumulator::snapshot() const
+{
+    std::lock_guard lock{ _snapshotMutex };
+    return _snapshot;
+}
+
+void MetricsAccumulator::observeVisibility(const Snapshot& snapshot) const
+{
+    auto visibleGeneration = _visibleGeneration.load(std::memory_order_relaxed);
+
+    // Only the first scrape of a generation records it
+    while (visibleGeneration < snapshot.generation) {
+        if (_visibleGeneration.compare_exchange_weak(visibleGeneration, snapshot.generation, std::memory_order_relaxed)) {
+            const auto now = std::chrono::steady_clock::now();
+
+            for (const auto& receipts : snapshot.receipts) {
+                if (receipts->generation <= visibleGeneration) {
+                    continue;
+                }
+
+                for (const auto received : receipts->received) {
+                    _visibilityLatencies.observe(microseconds(now - received), receipts->weight);
+                }
+            }
+
+            return;
+        }
+    }
+}
+
+const Instrumentation::Histogram& MetricsAccumulator::ingestLatencies() const
+{
+    return _ingestLatencies;
+}
+
+const Instrumentation::Histogram& MetricsAccumulator::visibilityLatencies() const
+{
+    return _visibilityLatencies;
+}
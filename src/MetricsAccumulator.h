@@ -1,31 +1,517 @@
 #pragma once
 
+#include "Instrumentation.h"
+#include "JsonFieldExtractor.h"
 #include "LoggerFactory.h"
+#include "TaskQueue.h"
+#include "TopicTrie.h"
 
+#include <array>
+#include <atomic>
 #include <chrono>
-#include <map>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class MetricsAccumulator
 {
 public:
-    explicit MetricsAccumulator(const LoggerFactory& loggerFactory);
+    struct Configuration
+    {
+        // Minimum time between publishing snapshots, zero publishes after every batch of changes
+        std::chrono::milliseconds publishInterval = std::chrono::milliseconds::zero();
+
+        // Maps the matching topics to metrics
+        struct Rule
+        {
+            // MQTT topic filter, can contain wildcards. "{name}" levels match like '+'
+            // and become labels, e.g. "home/{room}/temperature".
+            std::string topic;
+            // Name of the metric family, derived from the topic if empty
+            std::string metric;
+            // Metadata of the metric families, exposed if not empty. The name of the family should
+            // end with the unit, e.g. "temperature_celsius", otherwise OpenMetrics clients reject it.
+            std::string help;
+            std::string unit;
+            // Fields extracted from JSON payloads, nested fields are separated by dots.
+            // If empty the payload must be a plain number.
+            std::vector<std::string> fields;
+            // Series not updated for this long are removed, zero keeps them forever.
+            // Defaults to the TTL below.
+            std::optional<std::chrono::seconds> ttl;
+
+            // After processing a payload of a topic, later ones arriving within this interval are
+            // deferred to its end and only the latest of them is processed. Zero processes every
+            // payload. Defaults to the interval below.
+            std::optional<std::chrono::milliseconds> coalesceInterval;
+
+            // Series derived from the values of each metric of the rule, named after the metric.
+            // They are updated on every value and published with the snapshots.
+            struct Aggregation
+            {
+                // <metric>_messages_total counts the values
+                bool count = false;
+                // <metric>_min, <metric>_max and <metric>_avg over a rolling window, zero disables them
+                std::chrono::seconds window = std::chrono::seconds::zero();
+                // Upper bounds of the buckets of the <metric>_histogram histogram, empty disables it
+                std::vector<double> buckets;
+                // Quantiles of the <metric>_summary summary over the most recent values within
+                // the window, empty disables it
+                std::vector<double> quantiles;
+            };
+
+            Aggregation aggregation;
+        };
+
+        // The most specific rule matching a topic applies, payloads of other topics must be plain numbers
+        std::vector<Rule> rules;
+
+        // TTL of the series of topics without a rule or without a TTL of their own
+        std::chrono::seconds ttl = std::chrono::seconds::zero();
+
+        // Coalescing interval of topics without a rule or without an interval of their own
+        std::chrono::milliseconds coalesceInterval = std::chrono::milliseconds::zero();
+
+        // Limits of the series created from MQTT messages, zero is unlimited. The memory
+        // is an estimate of the bookkeeping of each series, in bytes.
+        std::size_t maxSeries = 0;
+        std::size_t maxMemory = 0;
+
+        enum class OverflowPolicy
+        {
+            // New series are rejected until others expire
+            Reject,
+            // The least recently updated series are removed to make room
+            Evict
+        };
+
+        OverflowPolicy overflowPolicy = OverflowPolicy::Reject;
+
+        // New series admitted per second, zero is unlimited. Up to a second's worth can be admitted at once.
+        double seriesAdmissionRate = 0.0;
+    };
+
+    MetricsAccumulator(
+        const LoggerFactory& loggerFactory,
+        TaskQueue& taskQueue,
+        Configuration config
+    );
+
+    // A payload of a topic matching a rule yields one metric per field found.
+    // `received` is when the message arrived, for the latency histograms.
+    void add(std::string_view topic, std::string_view payload, std::chrono::steady_clock::time_point received);
+
+    enum class MetricType
+    {
+        Gauge,
+        Counter,
+        Histogram,
+        Summary
+    };
+
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    // Cancels the timers and stops expiring series, so the TaskQueue can finish. Deferred payloads are dropped.
+    // Must be called from the same task key as add().
+    void stop();
+
+    struct Statistics
+    {
+        // Series created from MQTT messages
+        std::uint64_t series = 0;
+        std::uint64_t memory = 0;
+        // Values of new series dropped because of the limits or the admission rate
+        std::uint64_t rejectedSeries = 0;
+        std::uint64_t evictedSeries = 0;
+        std::uint64_t expiredSeries = 0;
+        // Payloads replaced by a later one of the same topic before being processed
+        std::uint64_t coalescedPayloads = 0;
+        std::uint64_t processedPayloads = 0;
+        // Processed payloads without a numeric value or any of the fields of the rule
+        std::uint64_t invalidPayloads = 0;
+    };
+
+    // Can be called from any thread
+    Statistics statistics() const;
+
+    // Index of a metric in the tables below, assigned when its topic is first seen
+    using MetricId = std::uint32_t;
 
-    void add(const std::string& key, std::string value);
+    // Properties shared by the series of a metric family
+    struct Family
+    {
+        std::string name;
+        MetricType type = MetricType::Gauge;
+        // Empty if unknown
+        std::string help;
+        std::string unit;
+    };
+
+    // Properties of a metric that never change after it's created
+    struct Series
+    {
+        std::shared_ptr<const Family> family;
+        Labels labels;
+    };
+
+    // Samples of a histogram or a summary
+    struct Distribution
+    {
+        std::uint64_t count = 0;
+        double sum = 0.0;
+        // Upper bound and cumulative count of each bucket but the +Inf one, or quantile and value
+        std::vector<std::pair<double, double>> points;
+    };
 
     struct Metric
     {
-        std::string value;
+        // Null if the slot is unused
+        std::shared_ptr<const Series> series;
+        double value = 0.0;
         std::chrono::system_clock::time_point timestamp;
+        // Set instead of the value for histograms and summaries
+        std::shared_ptr<const Distribution> distribution;
+    };
+
+    // Metrics are stored in fixed-size chunks which are shared with the
+    // published snapshots and copied on the first write after publishing
+    static constexpr std::size_t ChunkSize = 64;
+
+    struct Chunk
+    {
+        std::array<Metric, ChunkSize> metrics;
+        // Set if all metrics of the chunk belong to this family, otherwise each
+        // metric is a family of its own
+        std::shared_ptr<const Family> family;
+        // Set on the first chunk of the family, which is rendered with the family's
+        // metadata. The chunks of a family follow each other in snapshots.
+        bool familyStart = false;
     };
 
-    const auto& metrics() const
+    // Arrival times of a sample of the payloads first published in a generation
+    struct Receipts
     {
-        return _metrics;
-    }
+        std::uint64_t generation = 0;
+        // Number of payloads each sample stands for
+        std::uint64_t weight = 1;
+        std::vector<std::chrono::steady_clock::time_point> received;
+    };
+
+    // Immutable state of the metrics at the time of publishing, can be read from any thread.
+    // Unchanged chunks are shared between consecutive snapshots.
+    struct Snapshot
+    {
+        std::uint64_t generation = 0;
+        std::vector<std::shared_ptr<const Chunk>> chunks;
+        // Receipts of this and of the previous generations which weren't visible yet when it was published
+        std::vector<std::shared_ptr<const Receipts>> receipts;
+    };
+
+    // Can be called from any thread
+    std::shared_ptr<const Snapshot> snapshot() const;
+
+    // Records how long the payloads first included in a scrape of the snapshot took
+    // from arrival to being visible. Can be called from any thread.
+    void observeVisibility(const Snapshot& snapshot) const;
+
+    // In microseconds. Ingest latency is from arrival to being processed, including coalescing delays.
+    // Can be called from any thread.
+    const Instrumentation::Histogram& ingestLatencies() const;
+    const Instrumentation::Histogram& visibilityLatencies() const;
 
 private:
     spdlog::logger _log;
+    TaskQueue& _taskQueue;
+    const Configuration _config;
+
+    struct KeyHash
+    {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view key) const
+        {
+            return std::hash<std::string_view>{}(key);
+        }
+    };
+
+    static constexpr std::uint32_t NoList = UINT32_MAX;
+
+    struct CompiledRule
+    {
+        std::string topic;
+        std::string metric;
+        std::string help;
+        std::string unit;
+        std::vector<std::string> fields;
+        JsonFieldExtractor extractor;
+        std::uint32_t expiryList = NoList;
+        std::chrono::milliseconds coalesceInterval;
+        // Buckets sorted, quantiles within [0, 1]
+        Configuration::Rule::Aggregation aggregation;
+        bool aggregated = false;
+        // Estimated memory of the aggregation of a series
+        std::size_t aggregationMemory = 0;
+    };
+
+    std::vector<CompiledRule> _rules;
+    // Topic filter -> index in _rules
+    TopicTrie<std::size_t> _ruleTrie;
+    // Reused for every extraction, indexed by field
+    std::vector<std::optional<double>> _fieldValues;
+
+    static constexpr MetricId NoMetric = UINT32_MAX;
+    static constexpr std::uint32_t NoAggregator = UINT32_MAX;
+
+    // Refers to a metric as long as its slot isn't freed
+    struct MetricRef
+    {
+        MetricId id = NoMetric;
+        std::uint32_t generation = 0;
+    };
+
+    // Resolved when the topic is first seen
+    struct TopicEntry
+    {
+        // Key of the entry in _topics
+        const std::string* topic = nullptr;
+        // Null if no rule matches
+        const CompiledRule* rule = nullptr;
+        // Captured from the topic by the rule
+        Labels labels;
+        std::uint32_t expiryList = NoList;
+        // Metric of the payload or of each field of the rule, NoMetric until the first value
+        std::vector<MetricRef> metrics;
+
+        std::chrono::milliseconds coalesceInterval = std::chrono::milliseconds::zero();
+        // When the last payload was processed
+        std::chrono::steady_clock::time_point processed;
+        // Latest deferred payload, the entry is kept while one is pending
+        std::string pendingPayload;
+        std::chrono::system_clock::time_point pendingTimestamp;
+        std::chrono::steady_clock::time_point pendingReceived;
+        bool pending = false;
+        // Estimated memory, accounted against the limit once the entry refers to a series
+        std::uint32_t memory = 0;
+    };
+
+    // Raw topic -> metrics
+    std::unordered_map<std::string, TopicEntry, KeyHash, std::equal_to<>> _topics;
+
+    struct PendingTopic
+    {
+        std::chrono::steady_clock::time_point due;
+        TopicEntry* entry = nullptr;
+
+        // Orders the heap by the earliest due time
+        bool operator<(const PendingTopic& other) const
+        {
+            return due > other.due;
+        }
+    };
+
+    // Heap of the topics with a deferred payload
+    std::vector<PendingTopic> _pendingTopics;
+    TaskQueue::TimerHandle _coalesceTimer = 0;
+    std::chrono::steady_clock::time_point _coalesceTime;
+    // Series key (name and labels) -> metric, used when interning a new metric
+    std::unordered_map<std::string, MetricId, KeyHash, std::equal_to<>> _metricIdsBySeries;
+
+    static constexpr std::uint32_t NoChunk = UINT32_MAX;
+
+    struct FamilyEntry
+    {
+        std::shared_ptr<const Family> family;
+        // Families of rules with a metric name get chunks of their own, so that their
+        // series stay together. The others have a single series and share chunks.
+        bool grouped = false;
+        // Chunk the next series is placed in
+        std::uint32_t lastChunk = NoChunk;
+        // Slots of removed series in the family's chunks
+        std::vector<MetricId> freeIds;
+        std::size_t seriesCount = 0;
+    };
+
+    std::unordered_map<std::string, FamilyEntry, KeyHash, std::equal_to<>> _families;
+    std::uint32_t _sharedChunk = NoChunk;
+    std::vector<MetricId> _sharedFreeIds;
+
+    // Bookkeeping of a metric slot, indexed by MetricId
+    struct Slot
+    {
+        // Incremented when the slot is freed, invalidates the MetricRefs to it
+        std::uint32_t generation = 0;
+        // Keys of the topic entries referring to the series. Several topics can map to the
+        // same series, e.g. "a/b" and "a_b". Empty for derived series and free slots.
+        std::vector<const std::string*> topics;
+        // Null if the slot is free
+        const std::string* seriesKey = nullptr;
+        FamilyEntry* family = nullptr;
+        // Estimated memory, accounted against the limit
+        std::uint32_t memory = 0;
+        // Index in _aggregators if the series has derived ones
+        std::uint32_t aggregator = NoAggregator;
+        // Position in the expiry list
+        std::uint32_t expiryList = NoList;
+        MetricId previous = NoMetric;
+        MetricId next = NoMetric;
+    };
+
+    std::vector<Slot> _slots;
+
+    // The rolling window is split into this many slices, each keeping the aggregates of its values
+    static constexpr std::size_t WindowSlices = 8;
+    // Capacity of the ring of recent values the quantiles are computed from
+    static constexpr std::size_t SummaryValues = 128;
+
+    struct WindowSlice
+    {
+        // Time since the epoch in slice durations, identifies the slice the aggregates belong to
+        std::int64_t index = -1;
+        double min = 0.0;
+        double max = 0.0;
+        double sum = 0.0;
+        std::uint64_t count = 0;
+    };
+
+    // State of the derived series of a metric, updated in constant time per value
+    struct Aggregator
+    {
+        // NoMetric if the aggregator is free
+        MetricId source = NoMetric;
+        const CompiledRule* rule = nullptr;
+        // Derived series, NoMetric if not enabled by the rule or if another series has the name
+        MetricId count = NoMetric;
+        MetricId min = NoMetric;
+        MetricId max = NoMetric;
+        MetricId avg = NoMetric;
+        MetricId histogram = NoMetric;
+        MetricId summary = NoMetric;
+        std::chrono::system_clock::time_point timestamp;
+        // All values, and those that aren't NaN with their sum
+        std::uint64_t values = 0;
+        std::uint64_t observations = 0;
+        double sum = 0.0;
+        std::array<WindowSlice, WindowSlices> window;
+        // Non-cumulative, the last one is the +Inf bucket
+        std::vector<std::uint64_t> bucketCounts;
+        // Ring of the most recent values and their timestamps
+        std::vector<std::pair<std::chrono::system_clock::time_point, double>> recentValues;
+        std::size_t nextValue = 0;
+        // Queued for publishing
+        bool dirty = false;
+    };
+
+    std::vector<Aggregator> _aggregators;
+    std::vector<std::uint32_t> _freeAggregators;
+    std::vector<std::uint32_t> _dirtyAggregators;
+
+    // Series sharing a TTL, ordered by the time of their last update. Updating a series
+    // moves it to the tail, so the head is always the next one to expire. The heads are
+    // also the candidates for eviction. Series of a zero TTL are listed but never expire.
+    struct ExpiryList
+    {
+        std::chrono::seconds ttl;
+        MetricId head = NoMetric;
+        MetricId tail = NoMetric;
+    };
+
+    std::vector<ExpiryList> _expiryLists;
+    std::uint32_t _defaultExpiryList = NoList;
+    TaskQueue::TimerHandle _expiryTimer = 0;
+    std::chrono::system_clock::time_point _expiryTime;
+    bool _stopped = false;
+
+    // Fields of Statistics, written by the ingesting task and read by scrapes
+    struct Counters
+    {
+        std::atomic_uint64_t series{ 0 };
+        std::atomic_uint64_t memory{ 0 };
+        std::atomic_uint64_t rejectedSeries{ 0 };
+        std::atomic_uint64_t evictedSeries{ 0 };
+        std::atomic_uint64_t expiredSeries{ 0 };
+        std::atomic_uint64_t coalescedPayloads{ 0 };
+        std::atomic_uint64_t processedPayloads{ 0 };
+        std::atomic_uint64_t invalidPayloads{ 0 };
+    };
+
+    Counters _statistics;
+    // Token bucket of the admission rate
+    double _admissionTokens = 0.0;
+    std::chrono::steady_clock::time_point _admissionTime;
+
+    // Live copy of the metrics, only accessed from the ingesting task
+    std::vector<std::shared_ptr<Chunk>> _chunks;
+    // Number of used slots per chunk
+    std::vector<std::uint32_t> _chunkSizes;
+    // Indices into _chunks in the order they are published, chunks of a family are adjacent
+    std::vector<std::uint32_t> _chunkOrder;
+
+    // Only held while swapping or copying the pointer, never while ingesting or rendering
+    mutable std::mutex _snapshotMutex;
+    std::shared_ptr<const Snapshot> _snapshot;
+    std::uint64_t _generation = 0;
+    bool _publishScheduled = false;
+
+    // Arrival times sampled since the last publish. Once full, every other sample is
+    // dropped and the rest stand for twice as many payloads.
+    static constexpr std::size_t MaxReceiptSamples = 512;
+    // Receipts kept for the next scrape, older ones are dropped if nobody scrapes
+    static constexpr std::size_t MaxPendingReceipts = 32;
+
+    std::vector<std::chrono::steady_clock::time_point> _receipts;
+    std::uint64_t _receiptWeight = 1;
+    std::uint64_t _skippedReceipts = 0;
+    std::vector<std::shared_ptr<const Receipts>> _pendingReceipts;
+    Instrumentation::Histogram _ingestLatencies;
+    // Updated by the scraping threads
+    mutable Instrumentation::Histogram _visibilityLatencies;
+    mutable std::atomic_uint64_t _visibleGeneration{ 0 };
+
+    TopicEntry& resolve(std::string_view topic);
+    void process(
+        TopicEntry& entry,
+        std::string_view payload,
+        std::chrono::system_clock::time_point timestamp,
+        std::chrono::steady_clock::time_point received
+    );
+    void sampleReceipt(std::chrono::steady_clock::time_point received);
+    void scheduleCoalesced(std::chrono::steady_clock::time_point time);
+    void processCoalesced();
+    bool hasSeries(const TopicEntry& entry) const;
+    bool update(TopicEntry& entry, std::size_t field, double value, std::chrono::system_clock::time_point timestamp);
+    MetricId resolveMetric(TopicEntry& entry, std::size_t field);
+    MetricId intern(std::string_view topic, TopicEntry& entry, std::size_t field);
+    void attach(MetricId id, TopicEntry& entry, std::size_t entryMemory);
+    void eraseTopic(std::string_view topic);
+    MetricId intern(std::string key, Family family, bool grouped, const Labels& labels);
+    bool admit(std::size_t memory);
+    bool withinLimits(std::size_t series, std::size_t memory) const;
+    void evict();
+
+    void createAggregator(MetricId source, const CompiledRule& rule, const std::string& name, bool grouped, const Labels& labels);
+    void removeAggregator(std::uint32_t index);
+    void aggregate(std::uint32_t index, double value, std::chrono::system_clock::time_point timestamp);
+    void publishAggregator(Aggregator& aggregator);
+    MetricId allocate(FamilyEntry& familyEntry);
+    std::uint32_t addChunk(std::uint32_t after, const FamilyEntry* familyEntry);
+    void set(MetricId id, double value, std::chrono::system_clock::time_point timestamp);
+    void remove(MetricId id);
+
+    std::uint32_t expiryList(std::chrono::seconds ttl);
+    void link(MetricId id);
+    void unlink(MetricId id);
+    void scheduleExpiry(std::chrono::system_clock::time_point time);
+    void expire();
 
-    std::map<std::string, Metric> _metrics;
-};
\ No newline at end of file
+    const Metric& metric(MetricId id) const;
+    Metric& mutableMetric(MetricId id);
+    void schedulePublish();
+    void publish();
+};
@@ -0,0 +1,669 @@
+#include "MetricsFormat.h"
+#include "ContentNegotiation.h"
+#include "MetricValue.h"
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+namespace
+{
+    std::int64_t toMilliseconds(const std::chrono::system_clock::time_point timestamp)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()).count();
+    }
+
+    // "00" to "99", integers are converted two digits at a time
+    constexpr auto DigitPairs = [] {
+        std::array<char, 200> pairs{};
+
+        for (auto i = 0; i < 100; ++i) {
+            pairs[i * 2] = static_cast<char>('0' + i / 10);
+            pairs[i * 2 + 1] = static_cast<char>('0' + i % 10);
+        }
+
+        return pairs;
+    }();
+
+    // Timestamps are appended for every sample, so this avoids the generic conversion
+    void appendInteger(std::string& content, const std::int64_t value)
+    {
+        char buffer[24];
+        auto* const end = std::end(buffer);
+        auto* begin = end;
+
+        auto magnitude = value < 0 ? 0 - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+
+        while (magnitude >= 100) {
+            const auto pair = magnitude % 100 * 2;
+            magnitude /= 100;
+            *--begin = DigitPairs[pair + 1];
+            *--begin = DigitPairs[pair];
+        }
+
+        if (magnitude >= 10) {
+            *--begin = DigitPairs[magnitude * 2 + 1];
+            *--begin = DigitPairs[magnitude * 2];
+        } else {
+            *--begin = static_cast<char>('0' + magnitude);
+        }
+
+        if (value < 0) {
+            *--begin = '-';
+        }
+
+        content.append(begin, end);
+    }
+
+    enum class TimestampFormat
+    {
+        None,
+        // Prometheus text format
+        Milliseconds,
+        // OpenMetrics, with millisecond precision
+        Seconds
+    };
+
+    void appendTimestamp(
+        std::string& content,
+        const std::chrono::system_clock::time_point timestamp,
+        const TimestampFormat format
+    ) {
+        if (format == TimestampFormat::None) {
+            return;
+        }
+
+        const auto ms = toMilliseconds(timestamp);
+        content += ' ';
+
+        if (format == TimestampFormat::Milliseconds) {
+            appendInteger(content, ms);
+            return;
+        }
+
+        const auto fraction = ms % 1000;
+        appendInteger(content, ms / 1000);
+        content += '.';
+        content += static_cast<char>('0' + fraction / 100);
+        content.append(&DigitPairs[fraction % 100 * 2], 2);
+    }
+
+    // "le" of a histogram bucket or "quantile" of a summary
+    struct ExtraLabel
+    {
+        std::string_view name;
+        double value = 0.0;
+    };
+
+    // {name="value",...} with quotes, backslashes and newlines escaped
+    void appendLabels(
+        std::string& content,
+        const MetricsAccumulator::Labels& labels,
+        const ExtraLabel* extra = nullptr
+    ) {
+        if (labels.empty() && !extra) {
+            return;
+        }
+
+        auto separator = '{';
+
+        for (const auto& [name, value] : labels) {
+            content += separator;
+            content += name;
+            content += "=\"";
+
+            for (const auto c : value) {
+                switch (c) {
+                    case '\\':
+                        content += "\\\\";
+                        break;
+
+                    case '"':
+                        content += "\\\"";
+                        break;
+
+                    case '\n':
+                        content += "\\n";
+                        break;
+
+                    default:
+                        content += c;
+                        break;
+                }
+            }
+
+            content += '"';
+            separator = ',';
+        }
+
+        if (extra) {
+            content += separator;
+            content += extra->name;
+            content += "=\"";
+            appendMetricValue(content, extra->value);
+            content += '"';
+        }
+
+        content += '}';
+    }
+
+    void appendTypeLine(std::string& content, const std::string_view name, const MetricsAccumulator::MetricType type)
+    {
+        content += "# TYPE ";
+        content += name;
+
+        switch (type) {
+            case MetricsAccumulator::MetricType::Counter:
+                content += " counter\n";
+                break;
+
+            case MetricsAccumulator::MetricType::Histogram:
+                content += " histogram\n";
+                break;
+
+            case MetricsAccumulator::MetricType::Summary:
+                content += " summary\n";
+                break;
+
+            default:
+                content += " gauge\n";
+                break;
+        }
+    }
+
+    // "# HELP name text" with backslashes and newlines escaped, and quotes if `escapeQuotes` is set
+    void appendHelpLine(
+        std::string& content,
+        const std::string_view name,
+        const std::string_view help,
+        const bool escapeQuotes
+    ) {
+        content += "# HELP ";
+        content += name;
+        content += ' ';
+
+        for (const auto c : help) {
+            if (c == '\\') {
+                content += "\\\\";
+            } else if (c == '\n') {
+                content += "\\n";
+            } else if (c == '"' && escapeQuotes) {
+                content += "\\\"";
+            } else {
+                content += c;
+            }
+        }
+
+        content += '\n';
+    }
+
+    // Appends a line per sample of the metric, histograms and summaries have several
+    void appendSamples(
+        std::string& content,
+        const MetricsAccumulator::Metric& metric,
+        const TimestampFormat timestampFormat
+    ) {
+        const auto& series = *metric.series;
+        const auto& family = *series.family;
+
+        const auto appendSample = [&](const std::string_view suffix, const ExtraLabel* extra, const double value) {
+            content += family.name;
+            content += suffix;
+            appendLabels(content, series.labels, extra);
+            content += ' ';
+            appendMetricValue(content, value);
+            appendTimestamp(content, metric.timestamp, timestampFormat);
+            content += '\n';
+        };
+
+        if (!metric.distribution) {
+            appendSample({}, nullptr, metric.value);
+            return;
+        }
+
+        const auto& distribution = *metric.distribution;
+
+        if (family.type == MetricsAccumulator::MetricType::Histogram) {
+            for (const auto& [bound, count] : distribution.points) {
+                const ExtraLabel le{ "le", bound };
+                appendSample("_bucket", &le, count);
+            }
+
+            const ExtraLabel le{ "le", std::numeric_limits<double>::infinity() };
+            appendSample("_bucket", &le, static_cast<double>(distribution.count));
+        } else {
+            for (const auto& [quantile, value] : distribution.points) {
+                const ExtraLabel label{ "quantile", quantile };
+                appendSample({}, &label, value);
+            }
+        }
+
+        appendSample("_sum", nullptr, distribution.sum);
+        appendSample("_count", nullptr, static_cast<double>(distribution.count));
+    }
+
+    class TextFormatter final : public MetricsFormatter
+    {
+    public:
+        explicit TextFormatter(const bool timestamps)
+            : _timestamps{ timestamps }
+        {}
+
+        const char* contentType() const override
+        {
+            return "text/plain; version=0.0.4; charset=utf-8";
+        }
+
+        void render(const MetricsAccumulator::Chunk& chunk, std::string& content) const override
+        {
+            content.clear();
+
+            if (chunk.familyStart) {
+                appendMetadata(content, *chunk.family);
+            }
+
+            for (const auto& metric : chunk.metrics) {
+                if (!metric.series) {
+                    continue;
+                }
+
+                // Series of shared chunks are families of their own
+                if (!chunk.family) {
+                    appendMetadata(content, *metric.series->family);
+                }
+
+                appendSamples(content, metric, _timestamps ? TimestampFormat::Milliseconds : TimestampFormat::None);
+            }
+        }
+
+    private:
+        const bool _timestamps;
+
+        static void appendMetadata(std::string& content, const MetricsAccumulator::Family& family)
+        {
+            if (!family.help.empty()) {
+                appendHelpLine(content, family.name, family.help, false);
+            }
+
+            appendTypeLine(content, family.name, family.type);
+        }
+    };
+
+    class OpenMetricsFormatter final : public MetricsFormatter
+    {
+    public:
+        explicit OpenMetricsFormatter(const bool timestamps)
+            : _timestamps{ timestamps }
+        {}
+
+        // Counter samples end with "_total", their family name doesn't
+        static std::string_view familyName(const MetricsAccumulator::Family& family)
+        {
+            std::string_view name{ family.name };
+
+            if (family.type == MetricsAccumulator::MetricType::Counter && name.ends_with("_total")) {
+                name.remove_suffix(6);
+            }
+
+            return name;
+        }
+
+        const char* contentType() const override
+        {
+            return "application/openmetrics-text; version=1.0.0; charset=utf-8";
+        }
+
+        void render(const MetricsAccumulator::Chunk& chunk, std::string& content) const override
+        {
+            content.clear();
+
+            if (chunk.familyStart) {
+                appendMetadata(content, *chunk.family);
+            }
+
+            for (const auto& metric : chunk.metrics) {
+                if (!metric.series) {
+                    continue;
+                }
+
+                if (!chunk.family) {
+                    appendMetadata(content, *metric.series->family);
+                }
+
+                appendSamples(content, metric, _timestamps ? TimestampFormat::Seconds : TimestampFormat::None);
+            }
+        }
+
+        void renderEnd(std::string& content) const override
+        {
+            content += "# EOF\n";
+        }
+
+    private:
+        const bool _timestamps;
+
+        static void appendMetadata(std::string& content, const MetricsAccumulator::Family& family)
+        {
+            const auto name = familyName(family);
+
+            appendTypeLine(content, name, family.type);
+
+            if (!family.help.empty()) {
+                appendHelpLine(content, name, family.help, true);
+            }
+
+            // Clients reject units that aren't a suffix of the name
+            if (
+                !family.unit.empty()
+                && name.ends_with(family.unit)
+                && name.size() > family.unit.size()
+                && name[name.size() - family.unit.size() - 1] == '_'
+            ) {
+                content += "# UNIT ";
+                content += name;
+                content += ' ';
+                content += family.unit;
+                content += '\n';
+            }
+        }
+    };
+
+    // Hand-written encoder for the few messages of metrics.proto we need
+    class ProtobufFormatter final : public MetricsFormatter
+    {
+    public:
+        explicit ProtobufFormatter(const bool timestamps)
+            : _timestamps{ timestamps }
+        {}
+
+        const char* contentType() const override
+        {
+            return "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited";
+        }
+
+        void render(const MetricsAccumulator::Chunk& chunk, std::string& content) const override
+        {
+            content.clear();
+
+            // Consecutive series of the same family are encoded into one MetricFamily.
+            // A family spanning several chunks is sent as several messages.
+            const MetricsAccumulator::Family* family = nullptr;
+            std::string message;
+            std::string sample;
+            std::string label;
+
+            for (const auto& metric : chunk.metrics) {
+                if (!metric.series) {
+                    continue;
+                }
+
+                const auto& series = *metric.series;
+
+                if (series.family.get() != family) {
+                    appendFamily(content, family, message);
+                    family = series.family.get();
+                    message.clear();
+                }
+
+                // Metric: label = 1, gauge = 2 { value = 1 }, timestamp_ms = 6
+                sample.clear();
+
+                for (const auto& [name, value] : series.labels) {
+                    // LabelPair: name = 1, value = 2
+                    label.clear();
+                    appendString(label, 1, name);
+                    appendString(label, 2, value);
+                    appendString(sample, 1, label);
+                }
+
+                switch (series.family->type) {
+                    case MetricsAccumulator::MetricType::Histogram:
+                        appendHistogram(sample, metric.distribution.get());
+                        break;
+
+                    case MetricsAccumulator::MetricType::Summary:
+                        appendSummary(sample, metric.distribution.get());
+                        break;
+
+                    default:
+                        // Counter: counter = 3 { value = 1 }
+                        appendTag(sample, series.family->type == MetricsAccumulator::MetricType::Counter ? 3 : 2, LengthDelimited);
+                        appendVarint(sample, 9);
+                        appendDouble(sample, 1, metric.value);
+                        break;
+                }
+
+                if (_timestamps) {
+                    appendTag(sample, 6, Varint);
+                    appendVarint(sample, static_cast<std::uint64_t>(toMilliseconds(metric.timestamp)));
+                }
+
+                // MetricFamily: metric = 4
+                appendString(message, 4, sample);
+            }
+
+            appendFamily(content, family, message);
+        }
+
+    private:
+        enum WireType : std::uint8_t
+        {
+            Varint = 0,
+            Fixed64 = 1,
+            LengthDelimited = 2
+        };
+
+        const bool _timestamps;
+
+        // io.prometheus.client.MetricType
+        static constexpr std::uint64_t Counter = 0;
+        static constexpr std::uint64_t Gauge = 1;
+        static constexpr std::uint64_t Summary = 2;
+        static constexpr std::uint64_t Histogram = 4;
+
+        static void appendVarint(std::string& content, std::uint64_t value)
+        {
+            while (value >= 0x80) {
+                content += static_cast<char>(value | 0x80);
+                value >>= 7;
+            }
+
+            content += static_cast<char>(value);
+        }
+
+        static void appendTag(std::string& content, const std::uint32_t field, const WireType type)
+        {
+            appendVarint(content, (field << 3) | type);
+        }
+
+        static void appendFixed64(std::string& content, const std::uint64_t value)
+        {
+            // Little-endian regardless of the host
+            for (auto i = 0; i < 8; ++i) {
+                content += static_cast<char>(value >> (i * 8));
+            }
+        }
+
+        static void appendString(std::string& content, const std::uint32_t field, const std::string_view value)
+        {
+            appendTag(content, field, LengthDelimited);
+            appendVarint(content, value.size());
+            content += value;
+        }
+
+        static void appendDouble(std::string& content, const std::uint32_t field, const double value)
+        {
+            appendTag(content, field, Fixed64);
+            appendFixed64(content, std::bit_cast<std::uint64_t>(value));
+        }
+
+        // Metric: histogram = 7 { sample_count = 1, sample_sum = 2, bucket = 3 { cumulative_count = 1, upper_bound = 2 } }
+        static void appendHistogram(std::string& content, const MetricsAccumulator::Distribution* distribution)
+        {
+            std::string histogram;
+            std::string bucket;
+
+            if (distribution) {
+                appendTag(histogram, 1, Varint);
+                appendVarint(histogram, distribution->count);
+                appendDouble(histogram, 2, distribution->sum);
+
+                for (const auto& [bound, count] : distribution->points) {
+                    bucket.clear();
+                    appendTag(bucket, 1, Varint);
+                    appendVarint(bucket, static_cast<std::uint64_t>(count));
+                    appendDouble(bucket, 2, bound);
+                    appendString(histogram, 3, bucket);
+                }
+            }
+
+            appendString(content, 7, histogram);
+        }
+
+        // Metric: summary = 4 { sample_count = 1, sample_sum = 2, quantile = 3 { quantile = 1, value = 2 } }
+        static void appendSummary(std::string& content, const MetricsAccumulator::Distribution* distribution)
+        {
+            std::string summary;
+            std::string quantile;
+
+            if (distribution) {
+                appendTag(summary, 1, Varint);
+                appendVarint(summary, distribution->count);
+                appendDouble(summary, 2, distribution->sum);
+
+                for (const auto& [rank, value] : distribution->points) {
+                    quantile.clear();
+                    appendDouble(quantile, 1, rank);
+                    appendDouble(quantile, 2, value);
+                    appendString(summary, 3, quantile);
+                }
+            }
+
+            appendString(content, 4, summary);
+        }
+
+        static std::uint64_t metricType(const MetricsAccumulator::MetricType type)
+        {
+            switch (type) {
+                case MetricsAccumulator::MetricType::Counter:
+                    return Counter;
+
+                case MetricsAccumulator::MetricType::Histogram:
+                    return Histogram;
+
+                case MetricsAccumulator::MetricType::Summary:
+                    return Summary;
+
+                default:
+                    break;
+            }
+
+            return Gauge;
+        }
+
+        // Appends a length-delimited MetricFamily with the already encoded metrics
+        static void appendFamily(
+            std::string& content,
+            const MetricsAccumulator::Family* family,
+            const std::string_view metrics
+        ) {
+            if (!family) {
+                return;
+            }
+
+            // MetricFamily: name = 1, help = 2, type = 3, metric = 4, unit = 5
+            std::string header;
+            appendString(header, 1, family->name);
+
+            if (!family->help.empty()) {
+                appendString(header, 2, family->help);
+            }
+
+            appendTag(header, 3, Varint);
+            appendVarint(header, metricType(family->type));
+
+            std::string unit;
+
+            if (!family->unit.empty()) {
+                appendString(unit, 5, family->unit);
+            }
+
+            appendVarint(content, header.size() + metrics.size() + unit.size());
+            content += header;
+            content += metrics;
+            content += unit;
+        }
+    };
+}
+
+MetricsFormat negotiateMetricsFormat(const std::string_view accept)
+{
+    auto best = MetricsFormat::Text;
+    auto bestQuality = 0.0;
+
+    for (const auto& entry : parseAcceptHeader(accept)) {
+        std::optional<MetricsFormat> format;
+
+        if (equalsIgnoreCase(entry.value, "application/vnd.google.protobuf")) {
+            const auto proto = findParameter(entry.parameters, "proto");
+            const auto encoding = findParameter(entry.parameters, "encoding");
+
+            if (
+                proto && *proto == "io.prometheus.client.MetricFamily"
+                && encoding && *encoding == "delimited"
+            ) {
+                format = MetricsFormat::Protobuf;
+            }
+        } else if (equalsIgnoreCase(entry.value, "application/openmetrics-text")) {
+            const auto version = findParameter(entry.parameters, "version");
+
+            if (!version || version->starts_with("1.0")) {
+                format = MetricsFormat::OpenMetrics;
+            }
+        } else if (
+            equalsIgnoreCase(entry.value, "text/plain")
+            || equalsIgnoreCase(entry.value, "text/*")
+            || entry.value == "*/*"
+        ) {
+            format = MetricsFormat::Text;
+        }
+
+        if (
+            format
+            && entry.quality > 0
+            && (entry.quality > bestQuality || (entry.quality == bestQuality && *format > best))
+        ) {
+            best = *format;
+            bestQuality = entry.quality;
+        }
+    }
+
+    return best;
+}
+
+void MetricsFormatter::renderEnd(std::string&) const
+{}
+
+const MetricsFormatter& formatter(const MetricsFormat format, const bool timestamps)
+{
+    // Indexed by the timestamps flag
+    static const TextFormatter text[]{ TextFormatter{ false }, TextFormatter{ true } };
+    static const OpenMetricsFormatter openMetrics[]{ OpenMetricsFormatter{ false }, OpenMetricsFormatter{ true } };
+    static const ProtobufFormatter protobuf[]{ ProtobufFormatter{ false }, ProtobufFormatter{ true } };
+
+    switch (format) {
+        case MetricsFormat::OpenMetrics:
+            return openMetrics[timestamps];
+
+        case MetricsFormat::Protobuf:
+            return protobuf[timestamps];
+
+        default:
+            break;
+    }
+
+    return text[timestamps];
+}
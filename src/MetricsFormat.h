@@ -0,0 +1,44 @@
+#pragma once
+
+#include "MetricsAccumulator.h"
+
+#include <string>
+#include <string_view>
+
+// Exposition formats, ordered by preference when a client accepts several with equal weight
+enum class MetricsFormat
+{
+    // Prometheus text format 0.0.4
+    Text,
+    // OpenMetrics 1.0.0 text format
+    OpenMetrics,
+    // Length-delimited io.prometheus.client.MetricFamily messages
+    Protobuf
+};
+
+// Number of MetricsFormat values, can be used to size lookup tables
+inline constexpr auto MetricsFormatCount = 3u;
+
+// Picks the best supported format from the value of an Accept header
+MetricsFormat negotiateMetricsFormat(std::string_view accept);
+
+// Renders the metrics in one exposition format. The output of a chunk depends only on
+// the chunk, so it can be cached and concatenated with the output of other chunks.
+class MetricsFormatter
+{
+public:
+    virtual ~MetricsFormatter() = default;
+
+    // Value of the Content-Type header
+    virtual const char* contentType() const = 0;
+
+    // Replaces `content` with the rendered metrics of the chunk
+    virtual void render(const MetricsAccumulator::Chunk& chunk, std::string& content) const = 0;
+
+    // Appends what follows the last chunk
+    virtual void renderEnd(std::string& content) const;
+};
+
+// With `timestamps` every sample carries the time of its last update. Prometheus then stores
+// that time instead of the scrape time, but no longer marks series stale when they disappear.
+const MetricsFormatter& formatter(MetricsFormat format, bool timestamps = false);
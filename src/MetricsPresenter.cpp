@@ -1,32 +1,244 @@
-#include "MetricsAccumulator.h"
 #include "MetricsPresenter.h"
 
-#include <chrono>
-#include <sstream>
+#include <algorithm>
 
 MetricsPresenter::MetricsPresenter(
-    const MetricsAccumulator& metricsAccumulator
+    const MetricsAccumulator& metricsAccumulator,
+    Configuration config
 )
     : _metricsAccumulator{ metricsAccumulator }
+    , _config{ config }
 {}
 
-std::string MetricsPresenter::present() const
+void MetricsPresenter::setCollector(Collector&& collector)
 {
-    std::stringstream content;
+    _collector = std::move(collector);
+}
 
-    static constexpr auto Prefix = "mqtt";
+MetricsPresenter::Content MetricsPresenter::present(
+    const MetricsFormat format,
+    const ContentEncoding encoding
+) {
+    const auto snapshot = _metricsAccumulator.snapshot();
+    const auto& formatter = ::formatter(format, _config.timestamps);
 
-    for (const auto& [key, metric] : _metricsAccumulator.metrics()) {
-        content << fmt::format("# TYPE {}_{} gauge\n", Prefix, key);
+    // Collected outside the lock, concurrent scrapes only share the snapshot's content
+    auto tail = renderTail(formatter);
 
-        content
-            << fmt::format(
-                "{0}_{1} {2}\n",
-                Prefix,
-                key,
-                metric.value
-            );
+    if (encoding != ContentEncoding::Identity) {
+        tail = compress(tail, encoding);
+
+        if (tail.empty()) {
+            return {};
+        }
+    }
+
+    std::shared_ptr<const std::string> body;
+
+    {
+        std::lock_guard lock{ _mutex };
+
+        auto& cache = _caches[static_cast<std::size_t>(format)];
+
+        if (!cache.content || cache.generation != snapshot->generation) {
+            update(cache, formatter, *snapshot);
+        }
+
+        body = cache.content;
+
+        if (encoding != ContentEncoding::Identity) {
+            auto& encoded = cache.encodedContents[static_cast<std::size_t>(encoding)];
+
+            if (!encoded.content || encoded.generation != cache.generation) {
+                encoded.generation = cache.generation;
+                auto compressed = compress(*cache.content, encoding);
+
+                // Failures aren't cached, the next scrape tries again
+                if (compressed.empty()) {
+                    encoded.content.reset();
+                    return {};
+                }
+
+                encoded.content = std::make_shared<const std::string>(std::move(compressed));
+            }
+
+            body = encoded.content;
+        }
     }
 
-    return content.str();
-}
\ No newline at end of file
+    _metricsAccumulator.observeVisibility(*snapshot);
+
+    return { std::move(body), std::make_shared<const std::string>(std::move(tail)) };
+}
+
+std::string MetricsPresenter::renderTail(const MetricsFormatter& formatter) const
+{
+    std::string tail;
+
+    if (_collector) {
+        Collection collection;
+        _collector(collection);
+        collection.render(formatter, tail);
+    }
+
+    formatter.renderEnd(tail);
+
+    return tail;
+}
+
+void MetricsPresenter::update(
+    FormatCache& cache,
+    const MetricsFormatter& formatter,
+    const MetricsAccumulator::Snapshot& snapshot
+) {
+    decltype(cache.renderedChunks) renderedChunks;
+    renderedChunks.reserve(snapshot.chunks.size());
+
+    auto content = std::make_shared<std::string>();
+    content->reserve(cache.content ? cache.content->size() : 0);
+
+    for (const auto& chunk : snapshot.chunks) {
+        // Chunks are immutable once published, an unknown pointer means a change
+        if (auto node = cache.renderedChunks.extract(chunk.get())) {
+            *content += node.mapped().content;
+            renderedChunks.insert(std::move(node));
+        } else {
+            auto& rendered = renderedChunks.emplace(chunk.get(), RenderedChunk{ .chunk = chunk }).first->second;
+            formatter.render(*chunk, rendered.content);
+            *content += rendered.content;
+        }
+    }
+
+    // Chunks which aren't in the snapshot anymore are released
+    cache.renderedChunks = std::move(renderedChunks);
+
+    cache.generation = snapshot.generation;
+    cache.content = std::move(content);
+}
+
+MetricsPresenter::Stream MetricsPresenter::stream(const MetricsFormat format) const
+{
+    auto snapshot = _metricsAccumulator.snapshot();
+    _metricsAccumulator.observeVisibility(*snapshot);
+
+    const auto& formatter = ::formatter(format, _config.timestamps);
+
+    return Stream{ std::move(snapshot), formatter, renderTail(formatter) };
+}
+
+MetricsPresenter::Stream::Stream(
+    std::shared_ptr<const MetricsAccumulator::Snapshot> snapshot,
+    const MetricsFormatter& formatter,
+    std::string tail
+)
+    : _snapshot{ std::move(snapshot) }
+    , _formatter{ &formatter }
+    , _tail{ std::move(tail) }
+{}
+
+std::size_t MetricsPresenter::Stream::read(char* buffer, const std::size_t size)
+{
+    std::size_t written = 0;
+
+    while (written < size) {
+        if (_offset == _buffer.size()) {
+            if (_ended) {
+                break;
+            }
+
+            if (_nextChunk < _snapshot->chunks.size()) {
+                _formatter->render(*_snapshot->chunks[_nextChunk++], _buffer);
+            } else {
+                _buffer = std::move(_tail);
+                _ended = true;
+            }
+
+            _offset = 0;
+            continue;
+        }
+
+        const auto count = std::min(size - written, _buffer.size() - _offset);
+        std::copy_n(_buffer.data() + _offset, count, buffer + written);
+        _offset += count;
+        written += count;
+    }
+
+    return written;
+}
+
+void MetricsPresenter::Collection::add(
+    const std::string_view name,
+    const double value,
+    const MetricType type,
+    Labels labels
+) {
+    addMetric(name, type, std::move(labels)).value = value;
+}
+
+void MetricsPresenter::Collection::add(
+    const std::string_view name,
+    MetricsAccumulator::Distribution distribution,
+    const MetricType type,
+    Labels labels
+) {
+    addMetric(name, type, std::move(labels)).distribution = std::make_shared<const MetricsAccumulator::Distribution>(
+        std::move(distribution)
+    );
+}
+
+MetricsAccumulator::Metric& MetricsPresenter::Collection::addMetric(
+    const std::string_view name,
+    const MetricType type,
+    Labels labels
+) {
+    auto it = std::find_if(std::begin(_families), std::end(_families), [name](const auto& family) {
+        return family.family->name == name;
+    });
+
+    // The type of the first series applies to the family
+    if (it == std::end(_families)) {
+        _families.push_back(
+            FamilyMetrics{
+                .family = std::make_shared<const MetricsAccumulator::Family>(
+                    MetricsAccumulator::Family{
+                        .name = std::string{ name },
+                        .type = type
+                    }
+                )
+            }
+        );
+        it = std::prev(std::end(_families));
+    }
+
+    auto& metric = it->metrics.emplace_back();
+    metric.series = std::make_shared<const MetricsAccumulator::Series>(
+        MetricsAccumulator::Series{
+            .family = it->family,
+            .labels = std::move(labels)
+        }
+    );
+    metric.timestamp = _timestamp;
+
+    return metric;
+}
+
+void MetricsPresenter::Collection::render(const MetricsFormatter& formatter, std::string& content) const
+{
+    // Rendered through chunks like the accumulator's series, so every format supports them
+    auto chunk = std::make_unique<MetricsAccumulator::Chunk>();
+    std::string rendered;
+
+    for (const auto& [family, metrics] : _families) {
+        for (std::size_t start = 0; start < metrics.size(); start += MetricsAccumulator::ChunkSize) {
+            const auto count = std::min(metrics.size() - start, MetricsAccumulator::ChunkSize);
+
+            chunk->metrics = {};
+            std::copy_n(std::begin(metrics) + static_cast<std::ptrdiff_t>(start), count, std::begin(chunk->metrics));
+            chunk->family = family;
+            chunk->familyStart = start == 0;
+
+            formatter.render(*chunk, rendered);
+            content += rendered;
+        }
+    }
+}
@@ -1,18 +1,150 @@
 #pragma once
 
-#include <string>
+#include "Compression.h"
+#include "MetricsAccumulator.h"
+#include "MetricsFormat.h"
 
-class MetricsAccumulator;
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 class MetricsPresenter
 {
 public:
+    struct Configuration
+    {
+        // Exposes the time of the last update of every sample, see formatter()
+        bool timestamps = false;
+    };
+
     explicit MetricsPresenter(
-        const MetricsAccumulator& metricsAccumulator
+        const MetricsAccumulator& metricsAccumulator,
+        Configuration config
+    );
+
+    // Metrics of the exporter itself, collected on every scrape and rendered after the snapshot
+    class Collection
+    {
+    public:
+        using MetricType = MetricsAccumulator::MetricType;
+        using Labels = MetricsAccumulator::Labels;
+
+        void add(std::string_view name, double value, MetricType type = MetricType::Gauge, Labels labels = {});
+        // Histograms and summaries
+        void add(std::string_view name, MetricsAccumulator::Distribution distribution, MetricType type, Labels labels = {});
+
+        // Appends the collected families
+        void render(const MetricsFormatter& formatter, std::string& content) const;
+
+    private:
+        const std::chrono::system_clock::time_point _timestamp = std::chrono::system_clock::now();
+
+        struct FamilyMetrics
+        {
+            std::shared_ptr<const MetricsAccumulator::Family> family;
+            std::vector<MetricsAccumulator::Metric> metrics;
+        };
+
+        // In the order the families were first added
+        std::vector<FamilyMetrics> _families;
+
+        MetricsAccumulator::Metric& addMetric(std::string_view name, MetricType type, Labels labels);
+    };
+
+    // Called from the scraping thread, so it must only read thread-safe state
+    using Collector = std::function<void (Collection& collection)>;
+    void setCollector(Collector&& collector);
+
+    // Pieces of a response, sent one after the other without joining them
+    using Content = std::vector<std::shared_ptr<const std::string>>;
+
+    // Renders the latest snapshot of the accumulator and the collected metrics, can be called
+    // from any thread. Only the chunks changed since the previous call are rendered again.
+    // The snapshot's content is cached per generation, compressed or not, and shared by
+    // concurrent scrapes of the same generation. Only the collected metrics are rendered and
+    // compressed on every scrape, they follow as a piece of their own.
+    // Returns no pieces if the content can't be compressed.
+    Content present(
+        MetricsFormat format = MetricsFormat::Text,
+        ContentEncoding encoding = ContentEncoding::Identity
     );
 
-    std::string present() const;
+    // Renders a snapshot one accumulator chunk at a time, so only the series of
+    // a single chunk are held in memory. Nothing is cached between streams.
+    class Stream
+    {
+    public:
+        // `tail` follows the chunks of the snapshot
+        Stream(
+            std::shared_ptr<const MetricsAccumulator::Snapshot> snapshot,
+            const MetricsFormatter& formatter,
+            std::string tail
+        );
+
+        // Writes at most `size` bytes to `buffer` and returns their number, zero at the end
+        std::size_t read(char* buffer, std::size_t size);
+
+    private:
+        std::shared_ptr<const MetricsAccumulator::Snapshot> _snapshot;
+        const MetricsFormatter* _formatter;
+        std::size_t _nextChunk = 0;
+        std::string _tail;
+        bool _ended = false;
+        std::string _buffer;
+        std::size_t _offset = 0;
+    };
+
+    // Streams the latest snapshot of the accumulator, can be called from any thread
+    Stream stream(MetricsFormat format = MetricsFormat::Text) const;
 
 private:
     const MetricsAccumulator& _metricsAccumulator;
-};
\ No newline at end of file
+    const Configuration _config;
+    Collector _collector;
+
+    struct RenderedChunk
+    {
+        std::shared_ptr<const MetricsAccumulator::Chunk> chunk;
+        std::string content;
+    };
+
+    struct EncodedContent
+    {
+        std::uint64_t generation = 0;
+        std::shared_ptr<const std::string> content;
+    };
+
+    // Rendering state of one format, only filled once the format is requested
+    struct FormatCache
+    {
+        // Keyed by chunk identity, so chunks moved by an inserted one aren't rendered again.
+        // Holds only the chunks of the last rendered snapshot.
+        std::unordered_map<const MetricsAccumulator::Chunk*, RenderedChunk> renderedChunks;
+        std::uint64_t generation = 0;
+        // The snapshot's chunks, without the collected metrics and the end
+        std::shared_ptr<const std::string> content;
+        // Compressed content, to which the compressed tail of each scrape is appended as
+        // another gzip member or zstd frame. Indexed by ContentEncoding.
+        std::array<EncodedContent, ContentEncodingCount> encodedContents;
+    };
+
+    std::mutex _mutex;
+    // Indexed by MetricsFormat
+    std::array<FormatCache, MetricsFormatCount> _caches;
+
+    // Collected metrics and the end of the content
+    std::string renderTail(const MetricsFormatter& formatter) const;
+
+    static void update(
+        FormatCache& cache,
+        const MetricsFormatter& formatter,
+        const MetricsAccumulator::Snapshot& snapshot
+    );
+};
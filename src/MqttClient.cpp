@@ -14,6 +14,7 @@ MqttClient::MqttClient(
     : _log{ loggerFactory.create("MqttClient") }
     , _taskQueue{ taskQueue }
     , _config{ std::move(config) }
+    , _messages{ _config.messageQueueSize }
     , _stateMachine{
         SM::States::Disconnected{},
         SM::Transitions{
@@ -22,6 +23,15 @@ MqttClient::MqttClient(
         _taskQueue
     }
 {
+    // Inserted first, so a filter that is both denied and allowed is denied
+    for (const auto& filter : _config.deny) {
+        _topicFilter.insert(filter, false);
+    }
+
+    for (const auto& filter : _config.allow) {
+        _topicFilter.insert(filter, true);
+    }
+
     _log.info("Created: config={}", toString(_config));
 }
 
@@ -39,7 +49,12 @@ void MqttClient::stop()
     _log.info("Stopping");
 
     _reconnect = false;
-    
+
+    if (_reconnectTimer) {
+        _taskQueue.cancel(_reconnectTimer);
+        _reconnectTimer = 0;
+    }
+
     _stateMachine.dispatch(SM::Events::Disconnect{});
 }
 
@@ -68,22 +83,76 @@ void MqttClient::reconnect()
 {
     _log.debug("{}", __func__);
 
-    _taskQueue.push("MqttReconnect", [this](auto& options) {
+    if (_reconnectTimer) {
+        _taskQueue.cancel(_reconnectTimer);
+    }
+
+    static constexpr auto ReconnectDelay = 5s;
+
+    _reconnects.add();
+
+    _log.info("Reconnecting in {}s", ReconnectDelay.count());
+
+    _reconnectTimer = _taskQueue.pushDelayed("MqttReconnect", [this](auto&) {
+        _reconnectTimer = 0;
+
         // Avoid reconnecting if the client is already stopped
         if (!_reconnect) {
             return;
         }
-        if (!options.reQueued) {
-            options.reQueue = true;
-            options.after = 5s;
-            _log.info("Reconnecting in {}s", options.after.count() / 1000);
-        } else {
-            _log.info("Reconnecting");
-            _stateMachine.dispatch(SM::Events::Connect{});
-        }
+
+        _log.info("Reconnecting");
+        _stateMachine.dispatch(SM::Events::Connect{});
+    }, ReconnectDelay);
+}
+
+void MqttClient::scheduleMessageDrain()
+{
+    if (_drainScheduled.exchange(true)) {
+        return;
+    }
+
+    _taskQueue.push("MqttDrainMessages", [this](auto& options) {
+        drainMessages(options);
     });
 }
 
+void MqttClient::drainMessages(TaskQueue::TaskOptions& options)
+{
+    const auto count = _messages.drain(
+        _config.messageBatchSize,
+        [this](const MessageRing::Message& message) {
+            onMessage(
+                message.messageId,
+                message.topic,
+                message.payload,
+                message.qos,
+                message.retain,
+                message.received
+            );
+        }
+    );
+
+    _log.debug("{}: count={}", __func__, count);
+
+    if (_droppingMessages.exchange(false)) {
+        _log.warn("Message queue drained, dropped so far: {}", _droppedMessages.value());
+    }
+
+    if (count == _config.messageBatchSize) {
+        // There may be more messages, let other tasks run before continuing
+        options.reQueue = true;
+        return;
+    }
+
+    _drainScheduled = false;
+
+    // A message pushed after draining but before clearing the flag didn't schedule a new drain
+    if (!_messages.empty() && !_drainScheduled.exchange(true)) {
+        options.reQueue = true;
+    }
+}
+
 bool MqttClient::onConnect()
 {
     _log.debug("{}", __func__);
@@ -138,7 +207,7 @@ bool MqttClient::onConnect()
 
         self->_taskQueue.push("MqttOnPublish", [self, mid](auto&) {
             self->onPublish(mid);
-        });
+        }, 0, TaskQueue::Unordered);
     });
 
     mosquitto_subscribe_callback_set(
@@ -152,32 +221,45 @@ bool MqttClient::onConnect()
 
             self->_taskQueue.push("MqttOnSubscribe", [self, mid, grantedQos{ std::move(v) }](auto&) {
                 self->onSubscribe(mid, std::move(grantedQos));
-            });
+            }, 0, TaskQueue::Unordered);
         }
     );
 
     mosquitto_message_callback_set(_mosquitto, [](auto*, void* obj, const auto* msg) {
         auto* self = reinterpret_cast<MqttClient*>(obj);
+        const auto received = std::chrono::steady_clock::now();
 
-        std::vector<uint8_t> payload;
-        payload.resize(msg->payloadlen);
-        std::memcpy(payload.data(), msg->payload, msg->payloadlen);
-
-        std::string topic{ msg->topic };
-
-        self->_taskQueue.push(
-            "MqttOnMessage",
-            [
-                self,
-                payload{ std::move(payload) },
-                topic{std::move(topic) },
-                mid{ msg->mid },
-                qos{ msg->qos },
-                retain{ msg->retain }
-            ](auto&) {
-                self->onMessage(mid, std::move(topic), std::move(payload), qos, retain);
-            }
+        self->_receivedMessages.add();
+
+        // Unwanted messages are dropped before anything is copied or queued
+        if (!self->accepts(msg->topic)) {
+            self->_filteredMessages.add();
+            return;
+        }
+
+        const auto pushed = self->_messages.tryPush(
+            msg->mid,
+            msg->topic,
+            {
+                static_cast<const uint8_t*>(msg->payload),
+                static_cast<std::size_t>(msg->payloadlen)
+            },
+            msg->qos,
+            msg->retain,
+            received
         );
+
+        if (!pushed) {
+            self->_droppedMessages.add();
+
+            if (!self->_droppingMessages.exchange(true)) {
+                self->_log.warn("Message queue is full, dropping messages");
+            }
+
+            return;
+        }
+
+        self->scheduleMessageDrain();
     });
 
     if (const auto error = mosquitto_loop_start(_mosquitto); error != MOSQ_ERR_SUCCESS) {
@@ -311,38 +393,63 @@ void MqttClient::onSubscribe(const int messageId, std::vector<int> grantedQos)
 
 void MqttClient::onMessage(
     const int messageId,
-    std::string topic,
-    std::vector<uint8_t> payload,
+    const std::string_view topic,
+    const std::span<const uint8_t> payload,
     const int qos,
-    const bool retain
+    const bool retain,
+    const std::chrono::steady_clock::time_point received
 ) {
-    _log.debug(
-        "{}: messageId={}, topic={}, payload={}, qos={}, retain={}",
-        __func__,
-        messageId,
-        topic,
-        std::accumulate(
-            std::cbegin(payload),
-            std::cend(payload),
-            std::string{},
-            [](const auto& s, const auto& v) {
-                return s + (!s.empty() ? " " : "") + fmt::format("{:02X}", v);
-            }
-        ),
-        qos,
-        retain
-    );
+    // Formatting the payload is expensive, skip it unless it's actually logged
+    if (_log.should_log(spdlog::level::debug)) {
+        _log.debug(
+            "{}: messageId={}, topic={}, payload={}, qos={}, retain={}",
+            __func__,
+            messageId,
+            topic,
+            std::accumulate(
+                std::cbegin(payload),
+                std::cend(payload),
+                std::string{},
+                [](const auto& s, const auto& v) {
+                    return s + (!s.empty() ? " " : "") + fmt::format("{:02X}", v);
+                }
+            ),
+            qos,
+            retain
+        );
+    }
 
     if (_messageReceivedHandler) {
-        _messageReceivedHandler(std::move(topic), std::move(payload));
+        _messageReceivedHandler(topic, payload, received);
     }
 }
 
+MqttClient::Statistics MqttClient::statistics() const
+{
+    return Statistics{
+        .receivedMessages = _receivedMessages.value(),
+        .filteredMessages = _filteredMessages.value(),
+        .droppedMessages = _droppedMessages.value(),
+        .reconnects = _reconnects.value()
+    };
+}
+
+bool MqttClient::accepts(const std::string_view topic) const
+{
+    if (const auto* allowed = _topicFilter.find(topic)) {
+        return *allowed;
+    }
+
+    return _config.allow.empty();
+}
+
 std::string toString(const MqttClient::Configuration& config)
 {
     return fmt::format(
-        "{{brokerAddress={},brokerPort={}}}",
+        "{{brokerAddress={},brokerPort={},allow={},deny={}}}",
         config.brokerAddress,
-        config.brokerPort
+        config.brokerPort,
+        config.allow.size(),
+        config.deny.size()
     );
 }
\ No newline at end of file
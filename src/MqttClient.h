@@ -1,18 +1,24 @@
 #pragma once
 
+#include "Instrumentation.h"
 #include "LoggerFactory.h"
+#include "MessageRing.h"
 #include "StateMachine.h"
+#include "TaskQueue.h"
+#include "TopicTrie.h"
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <optional>
+#include <span>
+#include <string_view>
 #include <type_traits>
 #include <vector>
 
 #include <mosquitto.h>
 
-class TaskQueue;
-
 class MqttClient final
 {
 public:
@@ -24,6 +30,12 @@ public:
         int keepAlive = 5;
         std::string username;
         std::string password;
+        std::size_t messageQueueSize = 4096;
+        std::size_t messageBatchSize = 256;
+        // Topic filters of the messages to process, all if empty
+        std::vector<std::string> allow;
+        // Topic filters of the messages to drop, take precedence over equal allow filters
+        std::vector<std::string> deny;
     };
 
     MqttClient(
@@ -36,17 +48,53 @@ public:
     void stop();
     void subscribe(std::string topic);
 
-    using MessageReceivedHandler = std::function<void (std::string topic, std::vector<uint8_t> payload)>;
+    // The topic and payload point into a reused buffer, they are only valid during the call
+    // `received` is when the message arrived from the broker, before it was queued
+    using MessageReceivedHandler = std::function<void (
+        std::string_view topic,
+        std::span<const uint8_t> payload,
+        std::chrono::steady_clock::time_point received
+    )>;
     void setMessageReceivedHandler(MessageReceivedHandler&& handler);
 
+    struct Statistics
+    {
+        std::uint64_t receivedMessages = 0;
+        // Rejected by the allow/deny filters
+        std::uint64_t filteredMessages = 0;
+        // Dropped because the message queue was full
+        std::uint64_t droppedMessages = 0;
+        std::uint64_t reconnects = 0;
+    };
+
+    // Can be called from any thread
+    Statistics statistics() const;
+
 private:
     spdlog::logger _log;
     TaskQueue& _taskQueue;
     const Configuration _config;
     struct mosquitto* _mosquitto = nullptr;
     bool _reconnect = false;
+    TaskQueue::TimerHandle _reconnectTimer = 0;
     std::vector<std::string> _topics;
     MessageReceivedHandler _messageReceivedHandler;
+
+    // Messages are handed over from Mosquitto's thread through this ring
+    // and drained in batches by a single task
+    MessageRing _messages;
+    std::atomic_bool _drainScheduled{ false };
+    std::atomic_bool _droppingMessages{ false };
+    Instrumentation::Counter _droppedMessages;
+    Instrumentation::Counter _receivedMessages;
+    Instrumentation::Counter _filteredMessages;
+    Instrumentation::Counter _reconnects;
+
+    // Evaluated on Mosquitto's thread before a message is copied, the most specific
+    // matching filter decides. Immutable after construction.
+    TopicTrie<bool> _topicFilter;
+
+    bool accepts(std::string_view topic) const;
     
     struct SM
     {
@@ -139,6 +187,8 @@ private:
     StateMachine<SM::Event, SM::State, SM::Transitions> _stateMachine;
 
     void reconnect();
+    void scheduleMessageDrain();
+    void drainMessages(TaskQueue::TaskOptions& options);
 
     bool onConnect();
     void onConnected();
@@ -148,10 +198,11 @@ private:
     void onSubscribe(int messageId, std::vector<int> grantedQos);
     void onMessage(
         int messageId,
-        std::string topic,
-        std::vector<uint8_t> payload,
+        std::string_view topic,
+        std::span<const uint8_t> payload,
         int qos,
-        bool retain
+        bool retain,
+        std::chrono::steady_clock::time_point received
     );
 };
 
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only replacement for std::function that stores callables up to
+// `Capacity` bytes inline and only falls back to the heap for larger ones.
+template <typename Signature, std::size_t Capacity = 64>
+class SmallFunction;
+
+template <typename R, typename... Args, std::size_t Capacity>
+class SmallFunction<R (Args...), Capacity>
+{
+    static_assert(Capacity >= sizeof(void*), "Capacity must be able to hold a pointer");
+
+public:
+    SmallFunction() = default;
+
+    SmallFunction(std::nullptr_t)
+    {}
+
+    template <
+        typename F,
+        typename = std::enable_if_t<
+            !std::is_same_v<std::decay_t<F>, SmallFunction>
+            && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>
+        >
+    >
+    SmallFunction(F&& f)
+    {
+        using Callable = std::decay_t<F>;
+
+        if constexpr (fitsInline<Callable>()) {
+            new (&_storage) Callable(std::forward<F>(f));
+            _ops = &InlineOps<Callable>::Table;
+        } else {
+            *reinterpret_cast<Callable**>(&_storage) = new Callable(std::forward<F>(f));
+            _ops = &HeapOps<Callable>::Table;
+        }
+    }
+
+    SmallFunction(SmallFunction&& o) noexcept
+    {
+        moveFrom(o);
+    }
+
+    SmallFunction& operator=(SmallFunction&& o) noexcept
+    {
+        if (this != &o) {
+            reset();
+            moveFrom(o);
+        }
+
+        return *this;
+    }
+
+    SmallFunction(const SmallFunction&) = delete;
+    SmallFunction& operator=(const SmallFunction&) = delete;
+
+    ~SmallFunction()
+    {
+        reset();
+    }
+
+    R operator()(Args... args)
+    {
+        return _ops->invoke(&_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const
+    {
+        return _ops != nullptr;
+    }
+
+    template <typename Callable>
+    static constexpr bool fitsInline()
+    {
+        return
+            sizeof(Callable) <= Capacity
+            && alignof(Callable) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<Callable>;
+    }
+
+private:
+    struct Ops
+    {
+        R (*invoke)(void* storage, Args&&... args);
+        // Move-constructs the callable into `to` and destroys the one in `from`
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Callable>
+    struct InlineOps
+    {
+        static R invoke(void* storage, Args&&... args)
+        {
+            return (*static_cast<Callable*>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void relocate(void* from, void* to)
+        {
+            auto* callable = static_cast<Callable*>(from);
+            new (to) Callable(std::move(*callable));
+            callable->~Callable();
+        }
+
+        static void destroy(void* storage)
+        {
+            static_cast<Callable*>(storage)->~Callable();
+        }
+
+        static constexpr Ops Table{ &invoke, &relocate, &destroy };
+    };
+
+    template <typename Callable>
+    struct HeapOps
+    {
+        static R invoke(void* storage, Args&&... args)
+        {
+            return (**static_cast<Callable**>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void relocate(void* from, void* to)
+        {
+            *static_cast<Callable**>(to) = *static_cast<Callable**>(from);
+        }
+
+        static void destroy(void* storage)
+        {
+            delete *static_cast<Callable**>(storage);
+        }
+
+        static constexpr Ops Table{ &invoke, &relocate, &destroy };
+    };
+
+    alignas(std::max_align_t) std::byte _storage[Capacity];
+    const Ops* _ops = nullptr;
+
+    void moveFrom(SmallFunction& o)
+    {
+        if (o._ops) {
+            o._ops->relocate(&o._storage, &_storage);
+            _ops = o._ops;
+            o._ops = nullptr;
+        }
+    }
+
+    void reset()
+    {
+        if (_ops) {
+            _ops->destroy(&_storage);
+            _ops = nullptr;
+        }
+    }
+};
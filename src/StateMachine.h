@@ -11,11 +11,13 @@ public:
     StateMachine(
         TState initial,
         TTransitions transitions,
-        TaskQueue& taskQueue
+        TaskQueue& taskQueue,
+        const TaskQueue::Key taskKey = TaskQueue::DefaultKey
     )
         : _state{ std::move(initial) }
         , _transitions{ std::move(transitions) }
         , _taskQueue{ taskQueue }
+        , _taskKey{ taskKey }
     {}
 
     void dispatch(TEvent event)
@@ -27,7 +29,9 @@ public:
                 if (newState) {
                     _state = std::move(*newState);
                 }
-            }
+            },
+            0,
+            _taskKey
         );
     }
 
@@ -40,4 +44,5 @@ private:
     TState _state;
     TTransitions _transitions;
     TaskQueue& _taskQueue;
+    const TaskQueue::Key _taskKey;
 };
\ No newline at end of file
@@ -1,119 +1,509 @@
 #include "TaskQueue.h"
 
+#include <algorithm>
 #include <thread>
 
 using namespace std::chrono_literals;
 
-TaskQueue::TaskQueue(const LoggerFactory& loggerFactory)
+namespace
+{
+    // Microseconds
+    constexpr std::uint64_t TaskDurationBounds[]{
+        10, 50, 100, 500, 1'000, 5'000, 10'000, 50'000, 100'000, 500'000, 1'000'000
+    };
+
+    struct CurrentWorker
+    {
+        const TaskQueue* queue = nullptr;
+        std::size_t index = 0;
+    };
+
+    thread_local CurrentWorker currentWorker;
+}
+
+TaskQueue::TaskQueue(const LoggerFactory& loggerFactory, const std::size_t workerCount)
     : _log{ loggerFactory.create("TaskQueue") }
+    , _taskDurations{ TaskDurationBounds }
 {
-    _log.info("Created");
+    for (auto i = 0u; i < std::max<std::size_t>(workerCount, 1); ++i) {
+        _workers.push_back(std::make_unique<Worker>());
+    }
+
+    _log.info("Created: workers={}", _workers.size());
 }
 
 void TaskQueue::exec()
 {
     _log.debug("{} started", __func__);
 
+    std::vector<std::thread> threads;
+
+    for (auto i = 1u; i < _workers.size(); ++i) {
+        threads.emplace_back([this, i] {
+            runWorker(i);
+        });
+    }
+
+    runWorker(0);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    _log.debug("{} finished", __func__);
+}
+
+TaskQueue::Key TaskQueue::makeKey(const std::string_view name)
+{
+    const auto key = std::hash<std::string_view>{}(name);
+
+    // Avoid colliding with the reserved keys
+    if (key == DefaultKey || key == Unordered) {
+        return key + 2;
+    }
+
+    return key;
+}
+
+void TaskQueue::push(TaskId id, Task task, const int priority, const Key key)
+{
+    _log.debug("{}: id={}, priority={}, key={}", __func__, id, priority, key);
+
+    ++_outstanding;
+
+    enqueue(
+        QueueElement{
+            .id = id,
+            .task = std::move(task),
+            .priority = priority,
+            .key = key,
+            .sequence = _sequence++
+        }
+    );
+}
+
+TaskQueue::TimerHandle TaskQueue::pushDelayed(
+    const TaskId id,
+    Task task,
+    const std::chrono::milliseconds after,
+    const int priority,
+    const Key key
+) {
+    _log.debug("{}: id={}, priority={}, key={}, after={}ms", __func__, id, priority, key, after.count());
+
+    ++_outstanding;
+
+    TimerHandle handle = 0;
+
+    {
+        std::lock_guard lock{ _waitQueueMutex };
+        handle = addToWaitQueue(
+            QueueElement{
+                .id = id,
+                .task = std::move(task),
+                .priority = priority,
+                .key = key
+            },
+            std::chrono::steady_clock::now() + after
+        );
+    }
+
+    // The new task may be due earlier than the one the first worker is waiting for
+    notify(*_workers.front());
+
+    return handle;
+}
+
+bool TaskQueue::cancel(const TimerHandle handle)
+{
+    {
+        std::lock_guard lock{ _waitQueueMutex };
+
+        if (_pendingTimers.erase(handle) == 0) {
+            return false;
+        }
+
+        compactWaitQueue();
+        updateNextReQueueTime();
+    }
+
+    _log.debug("{}: handle={}", __func__, handle);
+
+    if (--_outstanding == 0 && _shutdown) {
+        notifyAll();
+    }
+
+    return true;
+}
+
+void TaskQueue::shutdown()
+{
+    _log.info("Shutting down");
+
+    _shutdown = true;
+
+    notifyAll();
+}
+
+std::size_t TaskQueue::queueDepth() const
+{
+    return _queued.load(std::memory_order_relaxed);
+}
+
+std::size_t TaskQueue::waitQueueDepth() const
+{
+    return _delayed.load(std::memory_order_relaxed);
+}
+
+const Instrumentation::HistogramTable& TaskQueue::taskDurations() const
+{
+    return _taskDurations;
+}
+
+void TaskQueue::runWorker(const std::size_t index)
+{
+    _log.debug("{} started: index={}", __func__, index);
+
+    currentWorker = CurrentWorker{
+        .queue = this,
+        .index = index
+    };
+
     while (true) {
-        while (!_queue.empty()) {
-            auto elem = [this] {
-                std::lock_guard lock{ _mutex };
-                auto task = _queue.top();
-                _queue.pop();
-                return task;
-            }();
-
-            if (elem.task) {
-                _log.debug(
-                    "executing: id={}, priority={}, remaining={}",
-                    elem.id,
-                    elem.priority,
-                    _queue.size()
-                );
+        if (index == 0) {
+            reQueueDelayedTasks(std::chrono::steady_clock::now());
+        }
 
-                TaskOptions taskOptions;
-                taskOptions.reQueued = elem.reQueued;
-                elem.task(taskOptions);
-
-                if (taskOptions.reQueue) {
-                    _log.debug("re-queuing: id={}", elem.id);
-
-                    if (taskOptions.after != std::chrono::milliseconds::zero()) {
-                        _log.debug(
-                            "moving task to wait queue: id={}, after={}ms",
-                            elem.id,
-                            taskOptions.after.count()
-                        );
-
-                        _waitQueue.push_back(
-                            WaitQueueElement{
-                                .queueElement = std::move(elem),
-                                .reQueueTime = std::chrono::steady_clock::now() + taskOptions.after
-                            }
-                        );
-                    } else {
-                        std::lock_guard lock{ _mutex };
-                        _queue.push(std::move(elem));
-                    }
-                }
+        if (auto elem = takeTask(index)) {
+            execute(std::move(*elem), index);
+            continue;
+        }
+
+        if (finished()) {
+            break;
+        }
+
+        sleep(index);
+    }
+
+    currentWorker = {};
+
+    _log.debug("{} finished: index={}", __func__, index);
+}
+
+std::optional<TaskQueue::QueueElement> TaskQueue::takeTask(const std::size_t index)
+{
+    {
+        auto& worker = *_workers[index];
+        std::lock_guard lock{ worker.mutex };
+
+        auto& keyed = worker.keyedQueue;
+        auto& unordered = worker.unorderedQueue;
+
+        if (!keyed.empty() || !unordered.empty()) {
+            const auto fromUnordered = keyed.empty() || (!unordered.empty() && keyed.front() < unordered.front());
+            auto elem = popHeap(fromUnordered ? unordered : keyed);
+
+            if (fromUnordered) {
+                --_unorderedCount;
             }
+
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+
+            return elem;
         }
+    }
+
+    if (_unorderedCount == 0) {
+        return std::nullopt;
+    }
 
-        auto delayedTaskReQueued = false;
-        const auto now = std::chrono::steady_clock::now();
-        for (auto it = std::begin(_waitQueue); it != std::end(_waitQueue);) {
-            if (now >= it->reQueueTime) {
-                auto elem = std::move(it->queueElement);
-                it = _waitQueue.erase(it);
+    for (auto i = 1u; i < _workers.size(); ++i) {
+        const auto victimIndex = (index + i) % _workers.size();
+        auto& victim = *_workers[victimIndex];
+        std::lock_guard lock{ victim.mutex };
 
+        if (!victim.unorderedQueue.empty()) {
+            auto elem = popHeap(victim.unorderedQueue);
+            --_unorderedCount;
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+
+            _log.debug("stealing: id={}, worker={}, victim={}", elem.id, index, victimIndex);
+
+            return elem;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void TaskQueue::execute(QueueElement&& elem, const std::size_t index)
+{
+    if (elem.task) {
+        _log.debug(
+            "executing: id={}, priority={}, worker={}",
+            elem.id,
+            elem.priority,
+            index
+        );
+
+        TaskOptions taskOptions;
+        taskOptions.reQueued = elem.reQueued;
+
+        const auto start = std::chrono::steady_clock::now();
+        elem.task(taskOptions);
+        const auto duration = std::chrono::steady_clock::now() - start;
+
+        _taskDurations[elem.id].observe(
+            static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count())
+        );
+
+        if (taskOptions.reQueue) {
+            _log.debug("re-queuing: id={}", elem.id);
+
+            if (taskOptions.after != std::chrono::milliseconds::zero()) {
                 _log.debug(
-                    "re-queuing delayed task: id={}, remaining={}",
+                    "moving task to wait queue: id={}, after={}ms",
                     elem.id,
-                    _waitQueue.size()
+                    taskOptions.after.count()
                 );
 
-                delayedTaskReQueued = true;
-
-                elem.reQueued = true;
+                {
+                    std::lock_guard lock{ _waitQueueMutex };
+                    addToWaitQueue(
+                        std::move(elem),
+                        std::chrono::steady_clock::now() + taskOptions.after
+                    );
+                }
 
-                std::lock_guard lock{ _mutex };
-                _queue.push(std::move(elem));
+                notify(*_workers.front());
             } else {
-                ++it;
+                elem.sequence = _sequence++;
+                enqueue(std::move(elem));
             }
+
+            return;
         }
+    }
 
-        if (_shutdown && _waitQueue.empty() && !delayedTaskReQueued) {
-            break;
+    if (--_outstanding == 0 && _shutdown) {
+        notifyAll();
+    }
+}
+
+void TaskQueue::sleep(const std::size_t index)
+{
+    auto& worker = *_workers[index];
+    std::unique_lock lock{ worker.mutex };
+
+    worker.sleeping = true;
+
+    const auto ready = [this, &worker, index] {
+        return
+            !worker.keyedQueue.empty()
+            || !worker.unorderedQueue.empty()
+            || _unorderedCount > 0
+            || finished()
+            || (index == 0 && std::chrono::steady_clock::now() >= nextReQueueTime());
+    };
+
+    // Sleep until a task is pushed or the earliest delayed task becomes due.
+    // The deadline is re-read after every wake-up since an earlier task may have been added.
+    while (!ready()) {
+        if (index == 0 && nextReQueueTime() != std::chrono::steady_clock::time_point::max()) {
+            worker.condition.wait_until(lock, nextReQueueTime());
+        } else {
+            worker.condition.wait(lock);
+        }
+    }
+
+    worker.sleeping = false;
+}
+
+bool TaskQueue::finished() const
+{
+    return _shutdown && _outstanding == 0;
+}
+
+void TaskQueue::pushHeap(std::vector<QueueElement>& heap, QueueElement&& elem)
+{
+    heap.push_back(std::move(elem));
+    std::push_heap(std::begin(heap), std::end(heap));
+}
+
+TaskQueue::QueueElement TaskQueue::popHeap(std::vector<QueueElement>& heap)
+{
+    // Moving out of the back avoids copying the task, unlike std::priority_queue::top()
+    std::pop_heap(std::begin(heap), std::end(heap));
+    auto elem = std::move(heap.back());
+    heap.pop_back();
+    return elem;
+}
+
+void TaskQueue::enqueue(QueueElement&& elem)
+{
+    _queued.fetch_add(1, std::memory_order_relaxed);
+
+    if (elem.key == Unordered) {
+        // Prefer the pushing worker to keep the data hot in its cache
+        const auto index = currentWorker.queue == this
+            ? currentWorker.index
+            : _nextWorker++ % _workers.size();
+
+        auto& worker = *_workers[index];
+
+        {
+            std::lock_guard lock{ worker.mutex };
+            pushHeap(worker.unorderedQueue, std::move(elem));
+            ++_unorderedCount;
+        }
+
+        notify(worker);
+
+        // The target may be busy, wake up an idle worker to steal the task
+        for (auto& other : _workers) {
+            if (other.get() != &worker && other->sleeping) {
+                notify(*other);
+                break;
+            }
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+        return;
     }
 
-    _log.debug("{} finished", __func__);
+    auto& worker = *_workers[elem.key % _workers.size()];
+
+    {
+        std::lock_guard lock{ worker.mutex };
+        pushHeap(worker.keyedQueue, std::move(elem));
+    }
+
+    notify(worker);
 }
 
-void TaskQueue::push(std::string id, Task task, const int priority)
+void TaskQueue::notify(Worker& worker)
 {
-    _log.debug("{}: id={}, priority={}", __func__, id, priority);
+    // Locking ensures the worker is either waiting or hasn't evaluated its wake-up condition yet
+    {
+        std::lock_guard lock{ worker.mutex };
+    }
 
-    std::lock_guard lock{ _mutex };
-    _queue.push(
-        QueueElement{
-            .id = std::move(id),
-            .task = std::move(task),
-            .priority = priority
+    worker.condition.notify_one();
+}
+
+void TaskQueue::notifyAll()
+{
+    for (auto& worker : _workers) {
+        notify(*worker);
+    }
+}
+
+TaskQueue::TimerHandle TaskQueue::addToWaitQueue(
+    QueueElement&& elem,
+    const std::chrono::steady_clock::time_point reQueueTime
+) {
+    const auto handle = ++_lastTimerHandle;
+
+    _waitQueue.push_back(
+        WaitQueueElement{
+            .queueElement = std::move(elem),
+            .reQueueTime = reQueueTime,
+            .handle = handle
         }
     );
+    std::push_heap(std::begin(_waitQueue), std::end(_waitQueue), std::greater<>{});
+
+    _pendingTimers.insert(handle);
+
+    updateNextReQueueTime();
+
+    return handle;
 }
 
-void TaskQueue::shutdown()
+void TaskQueue::reQueueDelayedTasks(const std::chrono::steady_clock::time_point now)
 {
-    _log.info("Shutting down");
-    _shutdown = true;
+    if (now < nextReQueueTime()) {
+        return;
+    }
+
+    std::vector<QueueElement> dueElements;
+
+    {
+        std::lock_guard lock{ _waitQueueMutex };
+
+        while (!_waitQueue.empty() && now >= _waitQueue.front().reQueueTime) {
+            std::pop_heap(std::begin(_waitQueue), std::end(_waitQueue), std::greater<>{});
+            auto elem = std::move(_waitQueue.back());
+            _waitQueue.pop_back();
+
+            if (_pendingTimers.erase(elem.handle) == 0) {
+                // Cancelled
+                continue;
+            }
+
+            _log.debug(
+                "re-queuing delayed task: id={}, remaining={}",
+                elem.queueElement.id,
+                _pendingTimers.size()
+            );
+
+            elem.queueElement.reQueued = true;
+            dueElements.push_back(std::move(elem.queueElement));
+        }
+
+        updateNextReQueueTime();
+    }
+
+    for (auto& elem : dueElements) {
+        elem.sequence = _sequence++;
+        enqueue(std::move(elem));
+    }
+}
+
+void TaskQueue::compactWaitQueue()
+{
+    // Cancelled elements are dropped lazily, rebuild the heap only when they
+    // make up the majority of it to keep cancellation amortized O(1)
+    if (_waitQueue.size() < 64 || _pendingTimers.size() * 2 > _waitQueue.size()) {
+        return;
+    }
+
+    std::erase_if(_waitQueue, [this](const WaitQueueElement& elem) {
+        return !_pendingTimers.contains(elem.handle);
+    });
+    std::make_heap(std::begin(_waitQueue), std::end(_waitQueue), std::greater<>{});
+}
+
+void TaskQueue::updateNextReQueueTime()
+{
+    const auto next = _waitQueue.empty()
+        ? std::chrono::steady_clock::time_point::max()
+        : _waitQueue.front().reQueueTime;
+
+    _nextReQueueTime = next.time_since_epoch().count();
+
+    // Called whenever the wait queue changes, cancelled elements aren't counted
+    _delayed.store(_pendingTimers.size(), std::memory_order_relaxed);
+}
+
+std::chrono::steady_clock::time_point TaskQueue::nextReQueueTime() const
+{
+    return std::chrono::steady_clock::time_point{
+        std::chrono::steady_clock::duration{ _nextReQueueTime.load() }
+    };
 }
 
 bool TaskQueue::QueueElement::operator<(const QueueElement& o) const
 {
-    return priority > o.priority;
-}
\ No newline at end of file
+    if (priority != o.priority) {
+        return priority > o.priority;
+    }
+
+    // Keep push order among tasks with the same priority
+    return sequence > o.sequence;
+}
+
+bool TaskQueue::WaitQueueElement::operator>(const WaitQueueElement& o) const
+{
+    return reQueueTime > o.reQueueTime;
+}
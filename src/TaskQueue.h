@@ -1,20 +1,28 @@
 #pragma once
 
+#include "Instrumentation.h"
 #include "LoggerFactory.h"
+#include "SmallFunction.h"
 
 #include <atomic>
 #include <chrono>
-#include <deque>
-#include <functional>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <mutex>
-#include <queue>
+#include <unordered_set>
+#include <vector>
 
 class TaskQueue
 {
 public:
-    TaskQueue(const LoggerFactory& loggerFactory);
+    TaskQueue(const LoggerFactory& loggerFactory, std::size_t workerCount = 1);
 
+    // Runs the workers, the calling thread becomes the first one.
+    // Returns after shutdown() when there are no more tasks to execute.
     void exec();
 
     struct TaskOptions
@@ -24,21 +32,64 @@ public:
         std::chrono::milliseconds after = std::chrono::milliseconds::zero();
     };
 
-    using Task = std::function<void (TaskOptions& options)>;
+    // Large enough to keep the closures used throughout the application inline
+    static constexpr std::size_t TaskStorageSize = 96;
 
-    void push(std::string id, Task task, int priority = 0);
+    using Task = SmallFunction<void (TaskOptions& options), TaskStorageSize>;
+
+    // Used for logging only. Must be a string literal or otherwise outlive the task.
+    using TaskId = const char*;
+
+    // Serialization key of a task. Tasks sharing a key are executed one at a time,
+    // in push order within the same priority. Tasks with different keys may run
+    // in parallel on different workers.
+    using Key = std::size_t;
+
+    // Used when no key is specified, keeps these tasks serialized with each other
+    static constexpr Key DefaultKey = 0;
+    // Tasks with this key have no ordering requirements, any idle worker can steal them
+    static constexpr Key Unordered = 1;
+
+    static Key makeKey(std::string_view name);
+
+    void push(TaskId id, Task task, int priority = 0, Key key = DefaultKey);
+
+    // Identifies a delayed task, can be used to cancel it before it becomes due.
+    // Zero is never returned as a valid handle.
+    using TimerHandle = std::uint64_t;
+
+    TimerHandle pushDelayed(
+        TaskId id,
+        Task task,
+        std::chrono::milliseconds after,
+        int priority = 0,
+        Key key = DefaultKey
+    );
+
+    bool cancel(TimerHandle handle);
 
     void shutdown();
 
+    // Number of tasks waiting for a worker, can be called from any thread
+    std::size_t queueDepth() const;
+
+    // Number of delayed tasks not yet due, can be called from any thread
+    std::size_t waitQueueDepth() const;
+
+    // Execution time of the tasks in microseconds, keyed by task id
+    const Instrumentation::HistogramTable& taskDurations() const;
+
 private:
     spdlog::logger _log;
 
     struct QueueElement
     {
-        std::string id;
+        TaskId id = nullptr;
         Task task;
         int priority = 0;
         bool reQueued = false;
+        Key key = DefaultKey;
+        std::uint64_t sequence = 0;
 
         bool operator<(const QueueElement& o) const;
     };
@@ -47,10 +98,67 @@ private:
     {
         QueueElement queueElement;
         std::chrono::steady_clock::time_point reQueueTime;
+        TimerHandle handle = 0;
+
+        bool operator>(const WaitQueueElement& o) const;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        // Heaps ordered by QueueElement::operator<, the next task is at the front.
+        // Keyed tasks are pinned to the worker selected by their key.
+        std::vector<QueueElement> keyedQueue;
+        // Unordered tasks can be stolen by idle workers
+        std::vector<QueueElement> unorderedQueue;
+        std::atomic_bool sleeping{ false };
     };
 
-    std::mutex _mutex;
-    std::priority_queue<QueueElement> _queue;
-    std::deque<WaitQueueElement> _waitQueue;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::atomic_size_t _nextWorker{ 0 };
+    std::atomic_size_t _unorderedCount{ 0 };
+    std::atomic_uint64_t _sequence{ 0 };
+
+    // Number of tasks queued, running or waiting in the wait queue
+    std::atomic_size_t _outstanding{ 0 };
+    // Subsets of the above, only used for instrumentation
+    std::atomic_size_t _queued{ 0 };
+    std::atomic_size_t _delayed{ 0 };
+    Instrumentation::HistogramTable _taskDurations;
     std::atomic_bool _shutdown{ false };
-};
\ No newline at end of file
+
+    // The first worker owns the wait queue: it sleeps until the earliest
+    // delayed task becomes due and moves it to the target worker
+    std::mutex _waitQueueMutex;
+    // Min-heap ordered by re-queue time. Cancelled elements stay in the heap
+    // until they reach the top or the heap gets compacted.
+    std::vector<WaitQueueElement> _waitQueue;
+    std::unordered_set<TimerHandle> _pendingTimers;
+    TimerHandle _lastTimerHandle = 0;
+    std::atomic<std::chrono::steady_clock::rep> _nextReQueueTime{
+        std::chrono::steady_clock::time_point::max().time_since_epoch().count()
+    };
+
+    void runWorker(std::size_t index);
+    std::optional<QueueElement> takeTask(std::size_t index);
+    void execute(QueueElement&& elem, std::size_t index);
+    void sleep(std::size_t index);
+    bool finished() const;
+
+    static void pushHeap(std::vector<QueueElement>& heap, QueueElement&& elem);
+    static QueueElement popHeap(std::vector<QueueElement>& heap);
+
+    void enqueue(QueueElement&& elem);
+    void notify(Worker& worker);
+    void notifyAll();
+
+    TimerHandle addToWaitQueue(
+        QueueElement&& elem,
+        std::chrono::steady_clock::time_point reQueueTime
+    );
+    void reQueueDelayedTasks(std::chrono::steady_clock::time_point now);
+    void compactWaitQueue();
+    void updateNextReQueueTime();
+    std::chrono::steady_clock::time_point nextReQueueTime() const;
+};
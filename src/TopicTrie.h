@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Maps MQTT topic filters to values. Filters are split into levels and stored in a trie,
+// so looking up a topic takes time proportional to its depth, not to the number of filters.
+// Besides the '+' and '#' wildcards, a "{name}" level matches a single level like '+'
+// and captures it as a label.
+template <typename Value>
+class TopicTrie
+{
+public:
+    // Label name and the topic level it captured
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    // Returns false if the filter was already inserted, the first value is kept
+    bool insert(const std::string_view filter, Value value)
+    {
+        std::uint32_t node = 0;
+        std::uint32_t level = 0;
+        std::vector<std::pair<std::uint32_t, std::string>> captures;
+        auto remaining = filter;
+
+        while (true) {
+            const auto end = remaining.find('/');
+            const auto part = remaining.substr(0, end);
+
+            if (part == "#") {
+                node = childOrCreate(node, &Node::multi);
+                break;
+            }
+
+            if (part == "+") {
+                node = childOrCreate(node, &Node::single);
+            } else if (part.size() > 2 && part.front() == '{' && part.back() == '}') {
+                captures.emplace_back(level, std::string{ part.substr(1, part.size() - 2) });
+                node = childOrCreate(node, &Node::single);
+            } else {
+                auto it = _nodes[node].literals.find(part);
+
+                if (it == std::end(_nodes[node].literals)) {
+                    const auto child = static_cast<std::uint32_t>(_nodes.size());
+                    _nodes[node].literals.emplace(std::string{ part }, child);
+                    _nodes.emplace_back();
+                    node = child;
+                } else {
+                    node = it->second;
+                }
+            }
+
+            if (end == std::string_view::npos) {
+                break;
+            }
+
+            remaining.remove_prefix(end + 1);
+            ++level;
+        }
+
+        if (_nodes[node].terminal != None) {
+            return false;
+        }
+
+        _nodes[node].terminal = static_cast<std::uint32_t>(_terminals.size());
+        _terminals.push_back(Terminal{ std::move(value), std::move(captures) });
+
+        return true;
+    }
+
+    // Returns null if no filter matches. At every level an exact match is preferred over
+    // '+' and '+' over '#'. As in MQTT, wildcards at the first level don't match topics
+    // starting with '$'. Captured levels are appended to `labels` if it's not null.
+    const Value* find(const std::string_view topic, Labels* labels = nullptr) const
+    {
+        if (_terminals.empty()) {
+            return nullptr;
+        }
+
+        const auto* terminal = match(0, topic, false, true);
+
+        if (!terminal) {
+            return nullptr;
+        }
+
+        if (labels) {
+            for (const auto& [level, name] : terminal->captures) {
+                labels->emplace_back(name, std::string{ topicLevel(topic, level) });
+            }
+        }
+
+        return &terminal->value;
+    }
+
+    bool empty() const
+    {
+        return _terminals.empty();
+    }
+
+private:
+    static constexpr std::uint32_t None = UINT32_MAX;
+
+    struct Hash
+    {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view key) const
+        {
+            return std::hash<std::string_view>{}(key);
+        }
+    };
+
+    struct Node
+    {
+        std::unordered_map<std::string, std::uint32_t, Hash, std::equal_to<>> literals;
+        // '+' or "{name}"
+        std::uint32_t single = None;
+        // '#', always a leaf
+        std::uint32_t multi = None;
+        std::uint32_t terminal = None;
+    };
+
+    struct Terminal
+    {
+        Value value;
+        // Level index and label name
+        std::vector<std::pair<std::uint32_t, std::string>> captures;
+    };
+
+    // The root is at index zero
+    std::vector<Node> _nodes{ 1 };
+    std::vector<Terminal> _terminals;
+
+    std::uint32_t childOrCreate(const std::uint32_t node, std::uint32_t Node::* member)
+    {
+        if (_nodes[node].*member == None) {
+            const auto child = static_cast<std::uint32_t>(_nodes.size());
+            _nodes[node].*member = child;
+            _nodes.emplace_back();
+        }
+
+        return _nodes[node].*member;
+    }
+
+    const Terminal* terminalOf(const std::uint32_t node) const
+    {
+        if (node == None || _nodes[node].terminal == None) {
+            return nullptr;
+        }
+
+        return &_terminals[_nodes[node].terminal];
+    }
+
+    // `done` is set once all levels of the topic are consumed
+    const Terminal* match(
+        const std::uint32_t node,
+        const std::string_view topic,
+        const bool done,
+        const bool first
+    ) const {
+        const auto& current = _nodes[node];
+
+        if (done) {
+            // "a/#" also matches "a"
+            if (const auto* terminal = terminalOf(node)) {
+                return terminal;
+            }
+
+            return terminalOf(current.multi);
+        }
+
+        const auto end = topic.find('/');
+        const auto level = topic.substr(0, end);
+        const auto rest = end != std::string_view::npos ? topic.substr(end + 1) : std::string_view{};
+        const auto last = end == std::string_view::npos;
+
+        if (const auto it = current.literals.find(level); it != std::end(current.literals)) {
+            if (const auto* terminal = match(it->second, rest, last, false)) {
+                return terminal;
+            }
+        }
+
+        if (first && level.starts_with('$')) {
+            return nullptr;
+        }
+
+        if (current.single != None) {
+            if (const auto* terminal = match(current.single, rest, last, false)) {
+                return terminal;
+            }
+        }
+
+        return terminalOf(current.multi);
+    }
+
+    static std::string_view topicLevel(std::string_view topic, std::uint32_t level)
+    {
+        for (; level > 0; --level) {
+            const auto end = topic.find('/');
+
+            if (end == std::string_view::npos) {
+                return {};
+            }
+
+            topic.remove_prefix(end + 1);
+        }
+
+        return topic.substr(0, topic.find('/'));
+    }
+};